@@ -0,0 +1,64 @@
+#!/bin/sh
+# Compare the package database layouts and backends.
+# See COPYING and COPYRIGHT files for corresponding information.
+#
+# Usage: bench/db.sh [packages [files]]
+#
+# Builds a scratch root with a synthetic database of the given number
+# of packages (default 2000) with the given number of files each
+# (default 500), converts it to every layout pkgrm(8) supports, and
+# times the usual queries and transactions.  Must be run as root from
+# the top of the source tree after `make'.  The sqlite layout is only
+# measured if pkgutils was built with SQLite support.
+
+set -e
+
+PACKAGES=${1:-2000}
+FILES=${2:-500}
+BIN=${BIN:-$PWD/src}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT INT TERM
+
+# milliseconds since the epoch (GNU date)
+now() { date +%s%3N; }
+
+# run a command, print its wall clock time
+timed() {
+	_name=$1; shift
+	_start=$(now)
+	"$@" >/dev/null
+	printf '  %-24s %6d ms\n' "$_name" $(($(now) - _start))
+}
+
+mkdir -p "$TMP/root/var/lib/pkg" "$TMP/pkg/usr/share/bench"
+echo bench > "$TMP/pkg/usr/share/bench/file"
+tar -czf "$TMP/bench#1-1.pkg.tar.gz" -C "$TMP/pkg" usr
+
+awk -v packages="$PACKAGES" -v files="$FILES" \
+	-f "$(dirname "$0")/gendb.awk" > "$TMP/root/var/lib/pkg/db"
+
+MID=$(printf 'pkg%05d' $((PACKAGES / 2)))
+
+echo "$PACKAGES packages, $FILES files each," \
+     "$(wc -c < "$TMP/root/var/lib/pkg/db") bytes"
+
+for layout in single sharded sqlite; do
+	if ! "$BIN/pkgrm" -r "$TMP/root" -c $layout 2>/dev/null; then
+		echo "$layout: not supported, skipped"
+		continue
+	fi
+
+	echo "$layout:"
+	timed "pkgadd"              "$BIN/pkgadd" -c /dev/null \
+		-r "$TMP/root" "$TMP/bench#1-1.pkg.tar.gz"
+	timed "pkgrm"               "$BIN/pkgrm" -r "$TMP/root" bench
+	timed "pkginfo -i"          "$BIN/pkginfo" -r "$TMP/root" -i
+	timed "pkginfo -l pkgname"  "$BIN/pkginfo" -r "$TMP/root" -l $MID
+	timed "pkginfo -o ^/path\$" "$BIN/pkginfo" -r "$TMP/root" \
+		-o "^/usr/share/$MID/file00000\$"
+	timed "pkginfo -o pattern"  "$BIN/pkginfo" -r "$TMP/root" \
+		-o "$MID/file00000\$"
+done
+
+# vim: cc=72 tw=70
+# End of file.
@@ -0,0 +1,20 @@
+# Print a synthetic package database.
+# See COPYING and COPYRIGHT files for corresponding information.
+#
+# Usage: awk -v packages=N -v files=M -f bench/gendb.awk
+#
+# Packages are named pkg00000, pkg00001, ..., each owns M files in
+# usr/share/<name>/ besides the shared usr/ and usr/share/.
+
+BEGIN {
+	for (p = 0; p < packages; p++) {
+		printf "pkg%05d\n1.%d-1\nusr/\nusr/share/\n", p, p
+		printf "usr/share/pkg%05d/\n", p
+		for (f = 0; f < files; f++)
+			printf "usr/share/pkg%05d/file%05d\n", p, f
+		printf "\n"
+	}
+}
+
+# vim: cc=72 tw=70
+# End of file.
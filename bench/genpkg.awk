@@ -0,0 +1,62 @@
+# Populate the directory of a synthetic package.
+# See COPYING and COPYRIGHT files for corresponding information.
+#
+# Usage: awk -v dir=DIR -v name=NAME -v version=VERSION \
+#            -v added=N -v bytes=M -f bench/genpkg.awk [files]
+#
+# Reads the file list of the installed version of the package, if
+# any, one path per line as printed by `pkginfo -l', adds N files in
+# usr/share/replay/<name>/<version>/ and writes the regular files to
+# DIR, whose directories must exist, with M bytes in total.  Prints
+# every directory that has to be created beforehand, one per line,
+# when dir is empty.
+
+{
+	sub(/^\//, "")
+	if ($0 != "")
+		path[n++] = $0
+}
+
+END {
+	base = "usr/share/replay/" name "/" version "/"
+	for (i = 0; i < added; i++)
+		path[n++] = sprintf("%sf%05d", base, i)
+
+	regular = 0
+	for (i = 0; i < n; i++)
+		if (path[i] !~ /\/$/)
+			regular++
+
+	if (dir == "") {
+		# each path and its parents
+		for (i = 0; i < n; i++) {
+			p = path[i]
+			if (p !~ /\/$/)
+				sub(/[^\/]*$/, "", p)
+			while (p != "" && !(p in seen)) {
+				seen[p] = 1
+				print p
+				sub(/[^\/]*\/$/, "", p)
+			}
+		}
+		exit
+	}
+
+	size = regular ? int(bytes / regular) : 0
+	chunk = "replay"
+	while (length(chunk) < 65536 && length(chunk) < size)
+		chunk = chunk chunk
+
+	for (i = 0; i < n; i++) {
+		if (path[i] ~ /\/$/)
+			continue
+		file = dir "/" path[i]
+		printf "" > file
+		for (left = size; left > 0; left -= length(chunk))
+			printf "%s", substr(chunk, 1, left) > file
+		close(file)
+	}
+}
+
+# vim: cc=72 tw=70
+# End of file.
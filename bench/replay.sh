@@ -0,0 +1,141 @@
+#!/bin/sh
+# Replay recorded transactions against a scratch root.
+# See COPYING and COPYRIGHT files for corresponding information.
+#
+# Usage: bench/replay.sh transactions db
+#
+# Builds a scratch root from a snapshot of the package database,
+# taken before the transactions and in the single file layout (see
+# `pkgrm -c single'), with an empty file for every file it lists.
+# Then replays each successful install, upgrade and removal of the
+# transaction log of pkgadd(8), /var/lib/pkg/transactions, in order,
+# and prints the time of each one next to the recorded time, and the
+# totals.  An install or upgrade uses the recorded package file if it
+# is still readable, unless SYNTH is set, and otherwise a package
+# generated from the installed file list, the number of files added
+# and the bytes written.  Must be run as root from the top of the
+# source tree after `make'; the root is mounted on tmpfs(5) unless
+# TMPFS is empty.
+
+set -e
+
+if [ $# -ne 2 ]; then
+	echo "usage: $0 transactions db" >&2
+	exit 1
+fi
+
+LOG=$1
+DB=$2
+BIN=${BIN:-$PWD/src}
+CONF=${CONF:-$PWD/extra/pkgadd.conf.sample}
+TMPFS=${TMPFS-yes}
+HERE=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d)
+ROOT=$TMP/root
+
+cleanup() {
+	umount "$ROOT" 2>/dev/null || :
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# milliseconds since the epoch (GNU date)
+now() { date +%s%3N; }
+
+# NUL-separated lines of stdin as arguments of a command in the root
+inroot() {
+	(cd "$ROOT" && tr '\n' '\0' | xargs -0 -r "$@")
+}
+
+mkdir -p "$ROOT"
+[ -z "$TMPFS" ] || mount -t tmpfs tmpfs "$ROOT" 2>/dev/null || :
+mkdir -p "$ROOT/var/lib/pkg"
+cp "$DB" "$ROOT/var/lib/pkg/db"
+
+# files of the records, i.e. lines after the name and version
+awk 'NF == 0 { line = 0; next } ++line > 2' "$DB" > "$TMP/files"
+awk -f "$HERE/genpkg.awk" "$TMP/files" | inroot mkdir -p
+grep -v '/$' "$TMP/files" | inroot touch
+
+echo "$(grep -c '^$' "$DB") packages," \
+     "$(wc -l < "$TMP/files") files in the snapshot"
+
+# tab separated: op, package, version, file, added, bytes, recorded
+# milliseconds; the string values are not unescaped
+awk '
+function str(key) {
+	if (!match($0, "\"" key "\":\"([^\"\\\\]|\\\\.)*\""))
+		return "-"
+	return substr($0, RSTART + length(key) + 4,
+	              RLENGTH - length(key) - 5)
+}
+function num(key) {
+	if (!match($0, "\"" key "\":[0-9]+"))
+		return 0
+	return substr($0, RSTART + length(key) + 3,
+	              RLENGTH - length(key) - 3)
+}
+/"outcome":"ok"/ {
+	OFS = "\t"
+	print str("op"), str("package"), str("new_version"), str("file"),
+	      num("added"), num("bytes"), int(num("duration_us") / 1000)
+}' "$LOG" > "$TMP/plan"
+
+printf '%5s %-8s %-32s %8s %8s\n' '#' op package ms recorded
+
+count=0 total=0 recorded_total=0 failed=0
+while IFS='	' read -r op name version file added bytes recorded; do
+	case $op in
+	install|upgrade)
+		if [ -z "$SYNTH" ] && [ -r "$file" ]; then
+			pkg=$file
+		else
+			dir=$TMP/pkg
+			pkg=$TMP/$name#$version.pkg.tar.gz
+			rm -rf "$dir" "$pkg"
+			mkdir -p "$dir"
+
+			"$BIN/pkginfo" -r "$ROOT" -l "$name" \
+				> "$TMP/installed" 2>/dev/null || :
+			set -- -v name="$name" -v version="$version" \
+				-v added="$added" -v bytes="$bytes" \
+				-f "$HERE/genpkg.awk" "$TMP/installed"
+			awk "$@" | (cd "$dir" && tr '\n' '\0' | xargs -0 -r mkdir -p)
+			awk -v dir="$dir" "$@"
+			(cd "$dir" && tar -czf "$pkg" $(ls -A))
+		fi
+		set -- "$BIN/pkgadd" -c "$CONF" -r "$ROOT"
+		[ "$op" = install ] || set -- "$@" -u
+		set -- "$@" "$pkg"
+		;;
+	remove)
+		set -- "$BIN/pkgrm" -r "$ROOT" "$name"
+		;;
+	*)
+		continue
+		;;
+	esac
+
+	count=$((count + 1))
+	start=$(now)
+	if "$@" </dev/null >/dev/null; then
+		status=
+	else
+		status=" failed"
+		failed=$((failed + 1))
+	fi
+	ms=$(($(now) - start))
+
+	total=$((total + ms))
+	recorded_total=$((recorded_total + recorded))
+	printf '%5d %-8s %-32s %8d %8d%s\n' \
+		$count $op "$name" $ms $recorded "$status"
+done < "$TMP/plan"
+
+printf '%5s %-8s %-32s %8d %8d\n' total '' \
+	"$count transactions" $total $recorded_total
+[ $failed -eq 0 ] || echo "$failed transaction(s) failed" >&2
+
+# vim: cc=72 tw=70
+# End of file.
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Measure the startup cost of query-only invocations.
+# See COPYING and COPYRIGHT files for corresponding information.
+#
+# Usage: bench/startup.sh [runs]
+#
+# Runs `pkginfo -i' on a scratch root with a few packages the given
+# number of times (default 1000) and prints the mean wall clock time
+# per call, next to the one of `sh -c :' as the cost of a bare exec.
+# BIN is the directory of the binaries, by default src/ of the
+# current directory.
+
+set -e
+
+RUNS=${1:-1000}
+BIN=${BIN:-$PWD/src}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT INT TERM
+
+mkdir -p "$TMP/var/lib/pkg"
+awk -v packages=50 -v files=10 \
+	-f "$(dirname "$0")/gendb.awk" > "$TMP/var/lib/pkg/db"
+
+# microseconds since the epoch (GNU date)
+now() { echo $(($(date +%s%N) / 1000)); }
+
+# run a command RUNS times, print the mean wall clock time
+timed() {
+	_name=$1; shift
+	_i=0
+	_start=$(now)
+	while [ $_i -lt "$RUNS" ]; do
+		"$@" >/dev/null
+		_i=$((_i + 1))
+	done
+	_us=$((($(now) - _start) / RUNS))
+	printf '  %-24s %4d.%03d ms\n' "$_name" $((_us / 1000)) $((_us % 1000))
+}
+
+timed "sh -c :"     sh -c :
+timed "pkginfo -V"  "$BIN/pkginfo" -V
+timed "pkginfo -i"  "$BIN/pkginfo" -r "$TMP" -i
+
+# vim: cc=72 tw=70
+# End of file.
@@ -0,0 +1,214 @@
+#!/bin/sh
+# Stress the database lock with concurrent readers and writers.
+# See COPYING and COPYRIGHT files for corresponding information.
+#
+# Usage: bench/stress.sh [readers [writers [seconds]]]
+#
+# Runs the given number of pkginfo(1) readers (default 4) and
+# pkgadd(8)/pkgrm(8) writers (default 2) against a scratch root on
+# tmpfs(5) for the given time (default 10 seconds).  The root has a
+# synthetic database of PACKAGES packages (default 1000) of FILES
+# empty files (default 50).  Readers cycle through listing, owner
+# and file list queries; each writer installs, upgrades and removes
+# a package of its own, retrying a step until it succeeds.
+#
+# Prints the attempts, successes, failures because the database was
+# locked, i.e. the LOCK_NB path of db_lock, other failures, and the
+# throughput and latency of readers and writers.  Then the outcomes
+# of the writers' transactions from the transaction log and the time
+# of their lock attempts; db_lock does not wait, so that is the cost
+# of locking, and contention shows up as the outcome "locked".
+# Finally checks the database with `pkginfo -kk' and the version of
+# every writer's package, and exits non-zero if anything is wrong.
+# Must be run as root from the top of the source tree after `make'.
+
+set -e
+
+READERS=${1:-4}
+WRITERS=${2:-2}
+DURATION=${3:-10}
+PACKAGES=${PACKAGES:-1000}
+FILES=${FILES:-50}
+BIN=${BIN:-$PWD/src}
+HERE=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d)
+ROOT=$TMP/root
+
+cleanup() {
+	kill $PIDS 2>/dev/null || :
+	wait 2>/dev/null || :
+	umount "$ROOT" 2>/dev/null || :
+	rm -rf "$TMP"
+}
+PIDS=
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# milliseconds since the epoch (GNU date)
+now() { date +%s%3N; }
+
+# run a command, print "CLASS STATUS MILLISECONDS" and return its
+# status; STATUS is ok, locked or failed, the standard error output
+# goes to $ERR of the worker
+attempt() {
+	_class=$1; shift
+	_start=$(now)
+	if "$@" >/dev/null 2>"$ERR"; then
+		_status=ok
+	elif grep -q 'currently locked' "$ERR"; then
+		_status=locked
+	else
+		_status=failed
+		sed "s/^/$_class: /" "$ERR" >> "$TMP/errors"
+	fi
+	echo "$_class $_status $(($(now) - _start))"
+	[ $_status = ok ]
+}
+
+mkdir -p "$ROOT"
+mount -t tmpfs tmpfs "$ROOT" 2>/dev/null || :
+mkdir -p "$ROOT/var/lib/pkg"
+
+awk -v packages="$PACKAGES" -v files="$FILES" \
+	-f "$HERE/gendb.awk" > "$ROOT/var/lib/pkg/db"
+
+# empty files for the database, whose directories are all listed
+awk 'NF == 0 { line = 0; next } ++line > 2' "$ROOT/var/lib/pkg/db" \
+	> "$TMP/files"
+grep '/$' "$TMP/files" | (cd "$ROOT" && xargs mkdir -p)
+grep -v '/$' "$TMP/files" | (cd "$ROOT" && xargs touch)
+
+# two releases of a package per writer
+w=0
+while [ $w -lt "$WRITERS" ]; do
+	for release in 1 2; do
+		dir=$TMP/pkg$w.$release
+		mkdir -p "$dir/usr/share/stress$w"
+		f=0
+		while [ $f -lt 20 ]; do
+			echo "$release" > "$dir/usr/share/stress$w/$f$release"
+			f=$((f + 1))
+		done
+		tar -czf "$TMP/stress$w#1-$release.pkg.tar.gz" -C "$dir" usr
+	done
+	w=$((w + 1))
+done
+
+MID=$(printf 'pkg%05d' $((PACKAGES / 2)))
+END=$(($(date +%s) + DURATION))
+
+reader() {
+	_n=0
+	while [ "$(date +%s)" -lt $END ]; do
+		case $((_n % 3)) in
+		0) attempt reader "$BIN/pkginfo" -r "$ROOT" -i ;;
+		1) attempt reader "$BIN/pkginfo" -r "$ROOT" -l $MID ;;
+		2) attempt reader "$BIN/pkginfo" -r "$ROOT" \
+			-o "^/usr/share/$MID/file00000\$" ;;
+		esac || :
+		_n=$((_n + 1))
+	done
+}
+
+# the last step that succeeded is kept in $TMP/state.N
+writer() {
+	_pkg=$TMP/stress$1
+	_step=0
+	while [ "$(date +%s)" -lt $END ]; do
+		case $_step in
+		0) attempt writer "$BIN/pkgadd" -c /dev/null -r "$ROOT" \
+			"$_pkg#1-1.pkg.tar.gz" ;;
+		1) attempt writer "$BIN/pkgadd" -c /dev/null -r "$ROOT" -u \
+			"$_pkg#1-2.pkg.tar.gz" ;;
+		2) attempt writer "$BIN/pkgrm" -r "$ROOT" stress$1 ;;
+		esac && {
+			_step=$(((_step + 1) % 3))
+			echo $_step > "$TMP/state.$1"
+		} || :
+	done
+}
+
+echo "$READERS readers, $WRITERS writers, $DURATION s," \
+     "$PACKAGES packages of $FILES files"
+
+i=0
+while [ $i -lt "$READERS" ]; do
+	(ERR=$TMP/err.r$i; reader > "$TMP/r$i.log") &
+	PIDS="$PIDS $!"
+	i=$((i + 1))
+done
+i=0
+while [ $i -lt "$WRITERS" ]; do
+	echo 0 > "$TMP/state.$i"
+	(ERR=$TMP/err.w$i; writer $i > "$TMP/w$i.log") &
+	PIDS="$PIDS $!"
+	i=$((i + 1))
+done
+wait
+PIDS=
+
+cat "$TMP"/[rw][0-9]*.log | awk -v seconds="$DURATION" '
+{
+	n[$1]++; s[$1, $2]++
+	if ($2 == "ok") {
+		ms[$1] += $3
+		if ($3 > max[$1])
+			max[$1] = $3
+	}
+}
+END {
+	printf "%-8s %8s %8s %8s %8s %8s %8s %8s\n", "", "attempts",
+	       "ok", "locked", "failed", "ok/s", "mean ms", "max ms"
+	for (c in n)
+		printf "%-8s %8d %8d %8d %8d %8.1f %8.1f %8d\n", c, n[c],
+		       s[c, "ok"], s[c, "locked"], s[c, "failed"],
+		       s[c, "ok"] / seconds,
+		       s[c, "ok"] ? ms[c] / s[c, "ok"] : 0, max[c]
+}'
+
+[ ! -s "$TMP/errors" ] || sort "$TMP/errors" | uniq -c | head >&2
+
+awk '
+match($0, /"outcome":"[a-z]+"/) {
+	outcome[substr($0, RSTART + 11, RLENGTH - 12)]++
+}
+match($0, /"lock_wait_us":[0-9]+/) {
+	us = substr($0, RSTART + 15, RLENGTH - 15) + 0
+	n++; sum += us
+	if (us > max)
+		max = us
+}
+END {
+	if (!n)
+		exit
+	printf "%d logged transactions:", n
+	for (o in outcome)
+		printf " %s %d", o, outcome[o]
+	printf "\nlock attempt: mean %d us, max %d us\n", sum / n, max
+}' "$ROOT/var/lib/pkg/transactions" 2>/dev/null || :
+
+# consistency: the database itself and each writer's package
+status=0
+"$BIN/pkginfo" -r "$ROOT" -kk || status=1
+
+"$BIN/pkginfo" -r "$ROOT" -i > "$TMP/installed"
+i=0
+while [ $i -lt "$WRITERS" ]; do
+	case $(cat "$TMP/state.$i") in
+	0) expect= ;;
+	1) expect="stress$i 1-1" ;;
+	2) expect="stress$i 1-2" ;;
+	esac
+	found=$(grep "^stress$i " "$TMP/installed" || :)
+	if [ "$found" != "$expect" ]; then
+		echo "writer $i: expected '$expect', found '$found'" >&2
+		status=1
+	fi
+	i=$((i + 1))
+done
+
+[ $status -ne 0 ] || echo "database consistent"
+exit $status
+
+# vim: cc=72 tw=70
+# End of file.
@@ -0,0 +1,81 @@
+#!/bin/sh
+# Training workload of the profile-guided build, see `make pgo'.
+# See COPYING and COPYRIGHT files for corresponding information.
+#
+# Usage: bench/train.sh [packages [files]]
+#
+# Runs the usual scenarios against a scratch root: reading a large
+# database (default 1000 packages of 200 files) in every text layout,
+# owner and list queries, the database check, footprints, and
+# install, upgrade and removal transactions.  The root is mounted on
+# tmpfs(5) when possible so that the profile is not dominated by
+# fsync(2).  Must be run as root; BIN is the directory of the
+# binaries, by default src/ of the current directory.
+
+set -e
+
+PACKAGES=${1:-1000}
+FILES=${2:-200}
+ROUNDS=${ROUNDS:-3}
+BIN=${BIN:-$PWD/src}
+HERE=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d)
+ROOT=$TMP/root
+
+cleanup() {
+	umount "$ROOT" 2>/dev/null || :
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+mkdir -p "$ROOT"
+mount -t tmpfs tmpfs "$ROOT" 2>/dev/null || :
+mkdir -p "$ROOT/var/lib/pkg"
+
+awk -v packages="$PACKAGES" -v files="$FILES" \
+	-f "$HERE/gendb.awk" > "$ROOT/var/lib/pkg/db"
+
+# two releases of a package, the second one drops and adds files
+for release in 1 2; do
+	dir=$TMP/pkg$release
+	mkdir -p "$dir/usr/bin" "$dir/usr/share/train" "$dir/etc"
+	echo "release $release" > "$dir/etc/train.conf"
+	echo "#!/bin/sh" > "$dir/usr/bin/train"
+	chmod 755 "$dir/usr/bin/train"
+	awk -v release=$release -v files="$FILES" -v dir="$dir" 'BEGIN {
+		for (f = release * 10; f < files + release * 10; f++)
+			print f > sprintf("%s/usr/share/train/%05d", dir, f)
+	}'
+	ln -s train "$dir/usr/bin/train$release"
+	tar -czf "$TMP/train#1-$release.pkg.tar.gz" -C "$dir" etc usr
+done
+
+MID=$(printf 'pkg%05d' $((PACKAGES / 2)))
+CONF=$HERE/../extra/pkgadd.conf.sample
+
+for layout in single sharded; do
+	"$BIN/pkgrm" -r "$ROOT" -c $layout
+
+	round=0
+	while [ $round -lt "$ROUNDS" ]; do
+		"$BIN/pkginfo" -r "$ROOT" -i
+		"$BIN/pkginfo" -r "$ROOT" -l $MID
+		"$BIN/pkginfo" -r "$ROOT" -o "^/usr/share/$MID/file00000\$"
+		"$BIN/pkginfo" -r "$ROOT" -o "file0000[0-9]\$"
+		"$BIN/pkginfo" -r "$ROOT" -k
+		"$BIN/pkginfo" -f "$TMP/train#1-1.pkg.tar.gz"
+
+		"$BIN/pkgadd" -c "$CONF" -r "$ROOT" "$TMP/train#1-1.pkg.tar.gz"
+		"$BIN/pkgadd" -c "$CONF" -r "$ROOT" -u "$TMP/train#1-2.pkg.tar.gz"
+		"$BIN/pkgadd" -c "$CONF" -r "$ROOT" -u -n \
+			"$TMP/train#1-1.pkg.tar.gz"
+		"$BIN/pkginfo" -r "$ROOT" -u
+		"$BIN/pkgrm" -r "$ROOT" train
+
+		round=$((round + 1))
+	done >/dev/null
+done
+
+# vim: cc=72 tw=70
+# End of file.
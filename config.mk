@@ -8,6 +8,25 @@ MANPREFIX   = $(PREFIX)/share/man
 BASHCOMPDIR = $(PREFIX)/share/bash-completion/completions
 VIMFILESDIR = $(PREFIX)/share/vim/vimfiles
 
+# Uncomment the first three lines and comment out the fourth one to
+# load libarchive(3) and the compression libraries it depends on when
+# a package file is first read, so that queries which do not touch
+# one start faster.  The binary then no longer records its dependency
+# on libarchive, which is opened by the SONAME below at run time; set
+# it to the one of the installed library, see
+# `objdump -p /usr/lib/libarchive.so | grep SONAME'.
+#ARCHIVE_SO   = libarchive.so.13
+#LAZY_ARCHIVE = -DENABLE_LAZY_ARCHIVE -DLIBARCHIVE_SO=\"$(ARCHIVE_SO)\"
+#ARCHIVE_LIBS = -ldl
+ARCHIVE_LIBS = -larchive
+
+# Uncomment to read the file lists of packages compressed with
+# gzip(1), xz(1) or zstd(1) without libarchive(3), which is faster for
+# pkginfo -l and -f and the first pass of pkgadd.  Anything unusual
+# still goes through libarchive.
+#NATIVE_TAR = -DENABLE_NATIVE_TAR
+#NATIVE_TAR_LIBS = -lz -llzma -lzstd
+
 # Uncomment to preserve packages' Access Control Lists by pkgadd.
 # See acl(5) for more information.
 # ``libarchive'' must be compiled with enabled ACL.
@@ -23,12 +42,37 @@ VIMFILESDIR = $(PREFIX)/share/vim/vimfiles
 # ``libarchive'' must be compiled with enabled xattrs support.
 #XATTR      = -DENABLE_EXTRACT_XATTR
 
+# Uncomment to read and write a package database compressed with
+# zstd(1).  See pkgadd(8) for more information.
+#ZSTD_DB    = -DENABLE_ZSTD_DB
+#ZSTD_LIBS  = -lzstd
+
+# Uncomment to support a package database in an SQLite file.
+# See pkgrm(8) for more information.
+#SQLITE_DB  = -DENABLE_SQLITE_DB
+#SQLITE_LIBS = -lsqlite3
+
+# Uncomment to compile in the static tracing probes listed in
+# src/probes.h, for bpftrace(8), perf(1) or SystemTap.  Needs
+# <sys/sdt.h>, e.g. from systemtap-sdt-dev; without it, the probes
+# cost nothing.
+#USDT       = -DENABLE_USDT
+
 # flags
 CPPFLAGS    = -D_POSIX_SOURCE -D_GNU_SOURCE -D_LARGEFILE_SOURCE \
               -D_FILE_OFFSET_BITS=64 -DNDEBUG -DVERSION=\"$(VERSION)\" \
-              $(ACL) $(XATTR)
-CXXFLAGS    = -std=c++0x -pedantic -Wall -Wextra
-LDFLAGS     = -larchive
+              $(LAZY_ARCHIVE) $(NATIVE_TAR) $(ACL) $(XATTR) \
+              $(ZSTD_DB) $(SQLITE_DB) $(USDT)
+CXXFLAGS    = -std=c++0x -pedantic -Wall -Wextra -pthread
+LDFLAGS     = $(ARCHIVE_LIBS) -pthread $(NATIVE_TAR_LIBS) $(ZSTD_LIBS) \
+              $(SQLITE_LIBS)
+
+# flags of the optimized builds, see `make lto' and `make pgo' in
+# src/; the profile flags are for GCC
+OPTFLAGS    = -O2
+LTOFLAGS    = -flto=auto
+PGOGEN      = -fprofile-generate -fprofile-update=atomic
+PGOUSE      = -fprofile-use -fprofile-correction -Wno-missing-profile
 
 # compiler and linker
 CXX         = c++
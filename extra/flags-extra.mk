@@ -4,12 +4,12 @@
 
 # includes and libs
 INCS     =
-LIBS     = -larchive
+LIBS     = -larchive -pthread
 
 # flags
 CPPFLAGS = -D_POSIX_SOURCE -D_GNU_SOURCE -D_LARGEFILE_SOURCE \
            -D_FILE_OFFSET_BITS=64 -DNDEBUG -DVERSION=\"$(VERSION)\"
-CXXFLAGS = -std=c++0x \
+CXXFLAGS = -std=c++0x -pthread \
            -pedantic \
            -Wall \
            -Warray-bounds=2 \
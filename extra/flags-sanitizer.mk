@@ -9,7 +9,7 @@ LIBS     = -larchive -lasan -lubsan
 # flags
 CPPFLAGS = -D_POSIX_SOURCE -D_GNU_SOURCE -D_LARGEFILE_SOURCE \
            -D_FILE_OFFSET_BITS=64 -DVERSION=\"$(VERSION)\"
-CXXFLAGS = -std=c++0x -O0 -ggdb3 -fno-omit-frame-pointer \
+CXXFLAGS = -std=c++0x -pthread -O0 -ggdb3 -fno-omit-frame-pointer \
            -fsanitize=address \
            -fsanitize=leak \
            -fsanitize=undefined \
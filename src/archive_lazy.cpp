@@ -0,0 +1,127 @@
+//! \file  archive_lazy.cpp
+//! \brief libarchive(3) loaded on first use.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#ifdef ENABLE_LAZY_ARCHIVE
+
+#include <stdexcept>
+#include <string>
+
+#include <dlfcn.h>
+/* libarchive */
+#include <archive.h>
+#include <archive_entry.h>
+
+#include "pathnames.h"
+
+using namespace std;
+
+/*
+ * Look up NAME in libarchive, which is loaded on the first call.
+ * Query modes never touch an archive, so they do not pay for loading
+ * and relocating libarchive and the compression libraries it
+ * depends on.
+ */
+static void*
+archive_symbol(const char* name)
+{
+  static void* handle = dlopen(LIBARCHIVE_SO, RTLD_NOW | RTLD_LOCAL);
+
+  void* sym = handle ? dlsym(handle, name) : 0;
+  if (!sym)
+  {
+    const char* error = dlerror();
+    throw runtime_error(string("cannot load ") + LIBARCHIVE_SO + ": " +
+                        (error ? error : name));
+  }
+
+  return sym;
+}
+
+/*
+ * Define NAME with the signature declared by libarchive's headers,
+ * forwarding to the function of the same name in the loaded library.
+ */
+#define LAZY(ret, name, params, args)                               \
+  ret name params                                                   \
+  {                                                                 \
+    static decltype(&::name) fn =                                   \
+      reinterpret_cast<decltype(&::name)>(archive_symbol(#name));   \
+    return fn args;                                                 \
+  }
+
+typedef struct archive        ar_t;
+typedef struct archive_entry  ae_t;
+
+extern "C" {
+
+LAZY(ar_t*,       archive_read_new,       (void), ())
+LAZY(int,         archive_read_free,      (ar_t* a), (a))
+LAZY(int,         archive_read_open_filename,
+                  (ar_t* a, const char* f, size_t n), (a, f, n))
+LAZY(int,         archive_read_next_header,
+                  (ar_t* a, ae_t** e), (a, e))
+LAZY(int,         archive_read_data_skip, (ar_t* a), (a))
+LAZY(int,         archive_read_data_block,
+                  (ar_t* a, const void** b, size_t* n, la_int64_t* o),
+                  (a, b, n, o))
+LAZY(int,         archive_read_extract2,
+                  (ar_t* a, ae_t* e, ar_t* d), (a, e, d))
+LAZY(int,         archive_read_support_format_tar,   (ar_t* a), (a))
+LAZY(int,         archive_read_support_filter_gzip,  (ar_t* a), (a))
+LAZY(int,         archive_read_support_filter_bzip2, (ar_t* a), (a))
+LAZY(int,         archive_read_support_filter_xz,    (ar_t* a), (a))
+LAZY(int,         archive_read_support_filter_lzip,  (ar_t* a), (a))
+LAZY(int,         archive_read_support_filter_zstd,  (ar_t* a), (a))
+
+LAZY(ar_t*,       archive_write_disk_new, (void), ())
+LAZY(int,         archive_write_free,     (ar_t* a), (a))
+LAZY(int,         archive_write_header,   (ar_t* a, ae_t* e), (a, e))
+LAZY(la_ssize_t,  archive_write_data_block,
+                  (ar_t* a, const void* b, size_t n, la_int64_t o),
+                  (a, b, n, o))
+LAZY(int,         archive_write_finish_entry, (ar_t* a), (a))
+LAZY(int,         archive_write_disk_set_options,
+                  (ar_t* a, int flags), (a, flags))
+LAZY(int,         archive_write_disk_set_standard_lookup, (ar_t* a), (a))
+LAZY(la_int64_t,  archive_write_disk_uid,
+                  (ar_t* a, const char* n, la_int64_t id), (a, n, id))
+LAZY(la_int64_t,  archive_write_disk_gid,
+                  (ar_t* a, const char* n, la_int64_t id), (a, n, id))
+
+LAZY(int,         archive_errno,          (ar_t* a), (a))
+LAZY(const char*, archive_error_string,   (ar_t* a), (a))
+LAZY(void,        archive_copy_error,     (ar_t* d, ar_t* s), (d, s))
+
+LAZY(const char*, archive_entry_pathname, (ae_t* e), (e))
+LAZY(void,        archive_entry_set_pathname,
+                  (ae_t* e, const char* p), (e, p))
+LAZY(const char*, archive_entry_hardlink, (ae_t* e), (e))
+LAZY(const char*, archive_entry_symlink,  (ae_t* e), (e))
+LAZY(la_int64_t,  archive_entry_size,     (ae_t* e), (e))
+LAZY(__LA_MODE_T, archive_entry_mode,     (ae_t* e), (e))
+LAZY(__LA_MODE_T, archive_entry_perm,     (ae_t* e), (e))
+LAZY(dev_t,       archive_entry_rdev,     (ae_t* e), (e))
+LAZY(la_int64_t,  archive_entry_uid,      (ae_t* e), (e))
+LAZY(la_int64_t,  archive_entry_gid,      (ae_t* e), (e))
+LAZY(const char*, archive_entry_uname,    (ae_t* e), (e))
+LAZY(const char*, archive_entry_gname,    (ae_t* e), (e))
+LAZY(time_t,      archive_entry_atime,    (ae_t* e), (e))
+LAZY(long,        archive_entry_atime_nsec,   (ae_t* e), (e))
+LAZY(int,         archive_entry_atime_is_set, (ae_t* e), (e))
+LAZY(time_t,      archive_entry_mtime,    (ae_t* e), (e))
+LAZY(long,        archive_entry_mtime_nsec,   (ae_t* e), (e))
+LAZY(int,         archive_entry_mtime_is_set, (ae_t* e), (e))
+#ifdef ENABLE_EXTRACT_ACL
+LAZY(int,         archive_entry_acl_count,    (ae_t* e, int t), (e, t))
+#endif
+#ifdef ENABLE_EXTRACT_XATTR
+LAZY(int,         archive_entry_xattr_count,  (ae_t* e), (e))
+#endif
+
+} // extern "C"
+
+#endif // ENABLE_LAZY_ARCHIVE
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
@@ -0,0 +1,104 @@
+//! \file  db.h
+//! \brief Package database backends definition.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#pragma once
+
+#include "pkgutil.h"
+
+/*
+ * Storage of the package database.  The packages are kept in memory
+ * by pkgutil; a backend loads them, possibly only the part a query
+ * needs, and persists the packages added and removed since.
+ */
+class db_backend
+{
+public:
+  typedef pkgutil::pkginfo_t  pkginfo_t;
+  typedef pkgutil::packages_t packages_t;
+
+  virtual ~db_backend() {}
+
+  /* read all packages and their files */
+  virtual void load(packages_t& packages) = 0;
+
+  /* read names and versions of all packages; false if the backend
+   * can't do that without load() */
+  virtual bool list(packages_t& packages) = 0;
+
+  /* read one package, if installed; false if the backend can't do
+   * that without load() */
+  virtual bool files_of(const string& name, packages_t& packages) = 0;
+
+  /* read the packages owning a file, with only that file; false if
+   * the backend can't do that without load() */
+  virtual bool owner_of(const string& file, packages_t& packages) = 0;
+
+  /* add or replace a package in the transaction */
+  virtual void add(const string& name, const pkginfo_t& info) = 0;
+
+  /* remove a package in the transaction */
+  virtual void remove(const string& name) = 0;
+
+  /* make the transaction durable; packages holds all packages */
+  virtual void commit(const packages_t& packages) = 0;
+
+  /* file or directory holding the database */
+  virtual string path() const = 0;
+}; // class db_backend
+
+#ifdef ENABLE_SQLITE_DB
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+/*
+ * Database in an SQLite file, indexed by package and by path.
+ */
+class db_sqlite : public db_backend
+{
+public:
+  /*
+   * Open FILENAME read-only until the first change, or create it
+   * with an empty schema if CREATE is set.
+   */
+  explicit db_sqlite(const string& filename, bool create = false);
+
+  virtual ~db_sqlite();
+
+  virtual void load(packages_t& packages) override;
+
+  virtual bool list(packages_t& packages) override;
+
+  virtual bool files_of(const string& name, packages_t& packages) override;
+
+  virtual bool owner_of(const string& file, packages_t& packages) override;
+
+  virtual void add(const string& name, const pkginfo_t& info) override;
+
+  virtual void remove(const string& name) override;
+
+  virtual void commit(const packages_t& packages) override;
+
+  virtual string path() const override { return filename; }
+
+private:
+  void open(int flags);
+
+  void exec(const char* sql);
+
+  sqlite3_stmt* prepare(const char* sql);
+
+  void begin();
+
+  [[noreturn]] void fail(const string& what);
+
+  string   filename;
+  sqlite3* handle;
+  bool     transaction;
+}; // class db_sqlite
+
+#endif // ENABLE_SQLITE_DB
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
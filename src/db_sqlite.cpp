@@ -0,0 +1,289 @@
+//! \file  db_sqlite.cpp
+//! \brief SQLite package database backend implementation.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#ifdef ENABLE_SQLITE_DB
+
+#include <memory>
+
+#include <sqlite3.h>
+
+#include "db.h"
+
+/*
+ * Finalizes a prepared statement when going out of scope.
+ */
+struct stmt_deleter
+{
+  void operator()(sqlite3_stmt* stmt) const { sqlite3_finalize(stmt); }
+};
+
+typedef unique_ptr<sqlite3_stmt, stmt_deleter> stmt_t;
+
+static string
+column_text(sqlite3_stmt* stmt, int column)
+{
+  const unsigned char* text = sqlite3_column_text(stmt, column);
+  return text ? reinterpret_cast<const char*>(text) : "";
+}
+
+db_sqlite::db_sqlite(const string& filename, bool create)
+  : filename(filename), handle(0), transaction(false)
+{
+  /*
+   * Readers don't need write access, the database is opened for
+   * writing by the first change.
+   */
+  if (!create)
+  {
+    open(SQLITE_OPEN_READONLY);
+    return;
+  }
+
+  open(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+
+  /*
+   * Files are looked up by package (primary key) and by path.  The
+   * default rollback journal is kept, so that the database can be
+   * read without write access to its directory.
+   */
+  exec("CREATE TABLE packages ("
+       "  name    TEXT PRIMARY KEY,"
+       "  version TEXT NOT NULL"
+       ") WITHOUT ROWID");
+  exec("CREATE TABLE files ("
+       "  package TEXT NOT NULL,"
+       "  path    TEXT NOT NULL,"
+       "  PRIMARY KEY (package, path)"
+       ") WITHOUT ROWID");
+  exec("CREATE INDEX files_path ON files (path)");
+}
+
+db_sqlite::~db_sqlite()
+{
+  /* an uncommitted transaction is rolled back */
+  sqlite3_close_v2(handle);
+}
+
+void
+db_sqlite::load(packages_t& packages)
+{
+  list(packages);
+
+  stmt_t stmt(prepare("SELECT package, path FROM files "
+                      "ORDER BY package, path"));
+
+  packages_t::iterator pkg = packages.end();
+  int rc;
+
+  while ((rc = sqlite3_step(stmt.get())) == SQLITE_ROW)
+  {
+    const string name = column_text(stmt.get(), 0);
+
+    if (pkg == packages.end() || pkg->first != name)
+      pkg = packages.find(name);
+
+    if (pkg != packages.end())
+      pkg->second.files.insert(pkg->second.files.end(),
+                               column_text(stmt.get(), 1));
+  }
+
+  if (rc != SQLITE_DONE)
+    fail("could not read " + filename);
+
+  /* packages without files are not installed */
+  for (packages_t::iterator i = packages.begin(); i != packages.end(); )
+  {
+    if (i->second.files.empty())
+      packages.erase(i++);
+    else
+      ++i;
+  }
+}
+
+bool
+db_sqlite::list(packages_t& packages)
+{
+  stmt_t stmt(prepare("SELECT name, version FROM packages"));
+  int    rc;
+
+  while ((rc = sqlite3_step(stmt.get())) == SQLITE_ROW)
+  {
+    packages.insert(packages.end(), make_pair(
+          column_text(stmt.get(), 0), pkginfo_t()))
+      ->second.version = column_text(stmt.get(), 1);
+  }
+
+  if (rc != SQLITE_DONE)
+    fail("could not read " + filename);
+
+  return true;
+}
+
+bool
+db_sqlite::files_of(const string& name, packages_t& packages)
+{
+  stmt_t stmt(prepare("SELECT p.version, f.path "
+                      "FROM packages p JOIN files f ON f.package = p.name "
+                      "WHERE p.name = ?1 ORDER BY f.path"));
+  sqlite3_bind_text(stmt.get(), 1, name.data(), name.size(),
+                    SQLITE_STATIC);
+
+  int rc;
+  while ((rc = sqlite3_step(stmt.get())) == SQLITE_ROW)
+  {
+    pkginfo_t& info = packages[name];
+
+    info.version = column_text(stmt.get(), 0);
+    info.files.insert(info.files.end(), column_text(stmt.get(), 1));
+  }
+
+  if (rc != SQLITE_DONE)
+    fail("could not read " + filename);
+
+  return true;
+}
+
+bool
+db_sqlite::owner_of(const string& file, packages_t& packages)
+{
+  stmt_t stmt(prepare("SELECT p.name, p.version "
+                      "FROM files f JOIN packages p ON p.name = f.package "
+                      "WHERE f.path = ?1"));
+  sqlite3_bind_text(stmt.get(), 1, file.data(), file.size(),
+                    SQLITE_STATIC);
+
+  int rc;
+  while ((rc = sqlite3_step(stmt.get())) == SQLITE_ROW)
+  {
+    pkginfo_t& info = packages[column_text(stmt.get(), 0)];
+
+    info.version = column_text(stmt.get(), 1);
+    info.files.insert(file);
+  }
+
+  if (rc != SQLITE_DONE)
+    fail("could not read " + filename);
+
+  return true;
+}
+
+void
+db_sqlite::add(const string& name, const pkginfo_t& info)
+{
+  remove(name);
+
+  stmt_t pkg(prepare("INSERT INTO packages (name, version) "
+                     "VALUES (?1, ?2)"));
+  sqlite3_bind_text(pkg.get(), 1, name.data(), name.size(),
+                    SQLITE_STATIC);
+  sqlite3_bind_text(pkg.get(), 2, info.version.data(),
+                    info.version.size(), SQLITE_STATIC);
+
+  if (sqlite3_step(pkg.get()) != SQLITE_DONE)
+    fail("could not add " + name + " to " + filename);
+
+  stmt_t file(prepare("INSERT INTO files (package, path) "
+                      "VALUES (?1, ?2)"));
+  sqlite3_bind_text(file.get(), 1, name.data(), name.size(),
+                    SQLITE_STATIC);
+
+  for (set<string>::const_iterator
+        i = info.files.begin(); i != info.files.end(); ++i)
+  {
+    sqlite3_bind_text(file.get(), 2, i->data(), i->size(),
+                      SQLITE_STATIC);
+
+    if (sqlite3_step(file.get()) != SQLITE_DONE)
+      fail("could not add " + name + " to " + filename);
+
+    sqlite3_reset(file.get());
+  }
+}
+
+void
+db_sqlite::remove(const string& name)
+{
+  begin();
+
+  static const char* const sql[] = {
+    "DELETE FROM files WHERE package = ?1",
+    "DELETE FROM packages WHERE name = ?1",
+  };
+
+  for (size_t i = 0; i < sizeof(sql) / sizeof(sql[0]); ++i)
+  {
+    stmt_t stmt(prepare(sql[i]));
+    sqlite3_bind_text(stmt.get(), 1, name.data(), name.size(),
+                      SQLITE_STATIC);
+
+    if (sqlite3_step(stmt.get()) != SQLITE_DONE)
+      fail("could not remove " + name + " from " + filename);
+  }
+}
+
+void
+db_sqlite::commit(const packages_t&)
+{
+  if (!transaction)
+    return;
+
+  exec("COMMIT");
+  transaction = false;
+}
+
+void
+db_sqlite::exec(const char* sql)
+{
+  if (sqlite3_exec(handle, sql, 0, 0, 0) != SQLITE_OK)
+    fail("could not update " + filename);
+}
+
+sqlite3_stmt*
+db_sqlite::prepare(const char* sql)
+{
+  sqlite3_stmt* stmt = 0;
+
+  if (sqlite3_prepare_v2(handle, sql, -1, &stmt, 0) != SQLITE_OK)
+    fail("could not read " + filename);
+
+  return stmt;
+}
+
+void
+db_sqlite::open(int flags)
+{
+  sqlite3_close_v2(handle);
+  handle = 0;
+
+  if (sqlite3_open_v2(filename.c_str(), &handle, flags, 0) != SQLITE_OK)
+    fail("could not open " + filename);
+
+  if (!(flags & SQLITE_OPEN_READONLY))
+    exec("PRAGMA synchronous = FULL");
+}
+
+void
+db_sqlite::begin()
+{
+  if (transaction)
+    return;
+
+  if (sqlite3_db_readonly(handle, "main"))
+    open(SQLITE_OPEN_READWRITE);
+
+  exec("BEGIN IMMEDIATE");
+  transaction = true;
+}
+
+void
+db_sqlite::fail(const string& what)
+{
+  throw runtime_error(what + ": " +
+      (handle ? sqlite3_errmsg(handle) : "out of memory"));
+}
+
+#endif // ENABLE_SQLITE_DB
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
@@ -0,0 +1,160 @@
+//! \file  latency.cpp
+//! \brief Latency histograms implementation.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <iomanip>
+
+#include <time.h>
+
+#include "latency.h"
+
+/* exact values below 2^SUB_BITS, then 2^(SUB_BITS-1) per octave */
+#define SUB_BITS  5
+#define SUB_HALF  (1 << (SUB_BITS - 1))
+#define BUCKETS   ((64 - SUB_BITS + 1) * SUB_HALF + SUB_HALF)
+
+typedef pair<uint64_t, string> slow_t;
+
+/*
+ * Format a duration with three significant digits or so.
+ */
+static string
+format_ns(uint64_t ns)
+{
+  char buf[32];
+
+  if (ns < 1000000)
+    snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+  else if (ns < 1000000000)
+    snprintf(buf, sizeof(buf), "%.2fms", ns / 1e6);
+  else
+    snprintf(buf, sizeof(buf), "%.2fs", ns / 1e9);
+
+  return buf;
+}
+
+latency_histogram::latency_histogram()
+  : counts(BUCKETS), total(0), low(UINT64_MAX), high(0)
+{
+}
+
+size_t
+latency_histogram::bucket(uint64_t ns)
+{
+  if (ns < (1 << SUB_BITS))
+    return ns;
+
+  /* shift that leaves the SUB_BITS most significant bits */
+  size_t shift = 63 - __builtin_clzll(ns) - (SUB_BITS - 1);
+
+  return shift * SUB_HALF + (ns >> shift);
+}
+
+uint64_t
+latency_histogram::bucket_high(size_t index)
+{
+  if (index < (1 << SUB_BITS))
+    return index;
+
+  size_t shift = index / SUB_HALF - 1;
+
+  return ((index - shift * SUB_HALF) << shift) + ((1ULL << shift) - 1);
+}
+
+void
+latency_histogram::record(uint64_t ns, const string& path)
+{
+  ++counts[bucket(ns)];
+  ++total;
+  low  = min(low, ns);
+  high = max(high, ns);
+
+  if (slowest.size() < LATENCY_TOP)
+  {
+    slowest.push_back(slow_t(ns, path));
+    push_heap(slowest.begin(), slowest.end(), greater<slow_t>());
+  }
+  else if (ns > slowest.front().first)
+  {
+    pop_heap(slowest.begin(), slowest.end(), greater<slow_t>());
+    slowest.back() = slow_t(ns, path);
+    push_heap(slowest.begin(), slowest.end(), greater<slow_t>());
+  }
+}
+
+uint64_t
+latency_histogram::percentile(double p) const
+{
+  if (!total)
+    return 0;
+
+  uint64_t rank = static_cast<uint64_t>(p / 100 * total + 0.5);
+  uint64_t seen = 0;
+
+  if (rank < 1)
+    rank = 1;
+
+  for (size_t i = 0; i < counts.size(); ++i)
+  {
+    seen += counts[i];
+    if (seen >= rank)
+      return max(low, min(high, bucket_high(i)));
+  }
+
+  return high;
+}
+
+void
+latency_histogram::print(ostream& out, const string& title) const
+{
+  if (!total)
+    return;
+
+  out << title << ": " << total
+      << ", min "   << format_ns(low)
+      << ", p50 "   << format_ns(percentile(50))
+      << ", p90 "   << format_ns(percentile(90))
+      << ", p99 "   << format_ns(percentile(99))
+      << ", p99.9 " << format_ns(percentile(99.9))
+      << ", max "   << format_ns(high) << endl;
+
+  vector<slow_t> sorted = slowest;
+  sort(sorted.begin(), sorted.end(), greater<slow_t>());
+
+  for (size_t i = 0; i < sorted.size(); ++i)
+    out << setw(10) << format_ns(sorted[i].first) << "  "
+        << sorted[i].second << endl;
+}
+
+latency_timer::latency_timer(latency_histogram* histogram,
+                             const string& path)
+  : histogram(histogram), path(path),
+    start(histogram ? latency_now() : 0)
+{
+}
+
+void
+latency_timer::stop()
+{
+  if (histogram)
+  {
+    histogram->record(latency_now() - start, path);
+    histogram = 0;
+  }
+}
+
+uint64_t
+latency_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
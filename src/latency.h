@@ -0,0 +1,90 @@
+//! \file  latency.h
+//! \brief Latency histograms of file operations.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/* slowest paths kept per histogram */
+#define LATENCY_TOP 10
+
+/*
+ * Histogram of durations in nanoseconds in the manner of
+ * HdrHistogram: values below 32 are counted exactly, larger ones in
+ * 16 linear buckets per power of two, so that any percentile is off
+ * by less than 6.25%.  The LATENCY_TOP slowest operations are kept
+ * with their paths.
+ */
+class latency_histogram
+{
+public:
+  latency_histogram();
+
+  void record(uint64_t ns, const string& path);
+
+  uint64_t count() const { return total; }
+
+  /* smallest recorded value that P percent of the values are below */
+  uint64_t percentile(double p) const;
+
+  /*
+   * Print "TITLE: COUNT, min ..., p50 ..., max ..." and the slowest
+   * paths, one per line.  Prints nothing if there are no values.
+   */
+  void print(ostream& out, const string& title) const;
+
+private:
+  static size_t   bucket(uint64_t ns);
+  static uint64_t bucket_high(size_t index);
+
+  vector<uint64_t>               counts;
+  uint64_t                       total;
+  uint64_t                       low;
+  uint64_t                       high;
+
+  /* min-heap of the slowest operations */
+  vector<pair<uint64_t, string>> slowest;
+}; // class latency_histogram
+
+/*
+ * Record the time from construction to stop() or destruction in
+ * HISTOGRAM, if it is not null.  The clock is not read otherwise.
+ * PATH is referenced, not copied, and must outlive the timer.
+ */
+class latency_timer
+{
+public:
+  latency_timer(latency_histogram* histogram, const string& path);
+
+  ~latency_timer() { stop(); }
+
+  void stop();
+
+private:
+  latency_histogram* histogram;
+  const string&      path;
+  uint64_t           start;
+}; // class latency_timer
+
+/*
+ * Histograms of the per-file operations of a transaction.
+ */
+struct latency_stats
+{
+  latency_histogram extract;  /* entries of pkg_install() */
+  latency_histogram unlink;   /* files removed from the root */
+  latency_histogram lstat;    /* files checked for conflicts */
+};
+
+/* monotonic clock in nanoseconds */
+uint64_t latency_now();
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
@@ -4,6 +4,12 @@
 
 #pragma once
 
+//!< Shared library loaded for reading and extracting packages,
+//!< see ARCHIVE_SO in config.mk.
+#ifndef LIBARCHIVE_SO
+#define LIBARCHIVE_SO           "libarchive.so.13"
+#endif
+
 //!< Default location for pkgadd configuration file.
 #define PKGADD_CONF             "/etc/pkgadd.conf"
 
@@ -13,12 +19,45 @@
 //!< Default package extension.
 #define PKG_EXT                 ".pkg.tar."
 
+//!< Default directory of package files for reverse lookups.
+#define PKG_REPO                "/var/cache/packages"
+
+//!< Default name of the file list index in a package directory.
+#define PKG_REPO_INDEX          ".pkginfo.index"
+
 //!< Default path for package database.
 #define PKG_DIR                 "var/lib/pkg"
 
 //!< Default package database location.
 #define PKG_DB                  "var/lib/pkg/db"
 
+//!< Default location for the package database split per package.
+#define PKG_DB_DIR              "var/lib/pkg/db.d"
+
+//!< Default location for the package database in an SQLite file.
+#define PKG_DB_SQLITE           "var/lib/pkg/db.sqlite"
+
+//!< Default zstd(1) level for a compressed package database.
+#define PKG_DB_ZSTD_LEVEL       1
+
+//!< Default location for the log of changed package files.
+#define PKG_CHANGES             "var/lib/pkg/changes"
+
+//!< Default location for the log of pkgadd and pkgrm transactions.
+#define PKG_TXLOG               "var/lib/pkg/transactions"
+
+//!< Default size in bytes after which the transaction log is rotated.
+#define PKG_TXLOG_MAX           (1024 * 1024)
+
+//!< Default number of rotated transaction logs that are kept.
+#define PKG_TXLOG_KEEP          4
+
+//!< Default location of the installed package files' identities.
+#define PKG_DB_IDENTITY         "var/lib/pkg/db.identity"
+
+//!< Default location of the installed packages' names and versions.
+#define PKG_DB_NAMES            "var/lib/pkg/db.names"
+
 //!< Default path for rejected files.
 #define PKG_REJECTED            "var/lib/pkg/rejected"
 
@@ -3,13 +3,18 @@
 //         See COPYING and COPYRIGHT files for corresponding information.
 
 #include <fstream>
+#include <algorithm>
 #include <iterator>
 #include <cstdio>
+#include <climits>
+#include <cstdlib>
 
 #include <regex.h>
 #include <unistd.h>
 
 #include "pkgadd.h"
+#include "latency.h"
+#include "txlog.h"
 
 set<string>
 pkgadd::make_keep_list(const set<string>&     files,
@@ -24,17 +29,10 @@ pkgadd::make_keep_list(const set<string>&     files,
   for (set<string>::const_iterator
         i = files.begin(); i != files.end(); ++i)
   {
-    for (vector<rule_t>::reverse_iterator
-          j = found.rbegin(); j != found.rend(); ++j)
-    {
-      if (rule_applies_to_file(*j, *i))
-      {
-        if (!(*j).action)
-          keep_list.insert(keep_list.end(), *i);
+    const rule_t* rule = decide_rule(found, *i);
 
-        break;
-      }
-    }
+    if (rule && !rule->action)
+      keep_list.insert(keep_list.end(), *i);
   }
 
 #ifndef NDEBUG
@@ -82,6 +80,54 @@ pkgadd::rule_applies_to_file(const rule_t&  rule,
   return ret;
 }
 
+const rule_t*
+pkgadd::decide_rule(const vector<rule_t>&  found,
+                    const string&          file)
+  const
+{
+  /*
+   * The last rule that applies decides.  For --explain, the rules
+   * shadowed by it are tested as well, outside of the statistics of
+   * the evaluation.
+   */
+  const rule_t* decided = 0;
+
+  for (vector<rule_t>::const_reverse_iterator
+        j = found.rbegin(); j != found.rend(); ++j)
+  {
+    if (!explain)
+    {
+      if (rule_applies_to_file(*j, file))
+        return &*j;
+      continue;
+    }
+
+    rule_stats_t& stats = rule_stats[j->line];
+
+    if (decided)
+    {
+      if (rule_applies_to_file(*j, file))
+        ++stats.matched;
+      continue;
+    }
+
+    uint64_t start   = latency_now();
+    bool     applies = rule_applies_to_file(*j, file);
+
+    stats.ns += latency_now() - start;
+    ++stats.evaluated;
+
+    if (applies)
+    {
+      ++stats.matched;
+      ++stats.won;
+      decided = &*j;
+    }
+  }
+
+  return decided;
+}
+
 set<string>
 pkgadd::apply_install_rules(const string&          name,
                             pkginfo_t&             info,
@@ -97,19 +143,9 @@ pkgadd::apply_install_rules(const string&          name,
   for (set<string>::const_iterator
         i = info.files.begin(); i != info.files.end(); ++i)
   {
-    bool install_file = true;
-
-    for (vector<rule_t>::reverse_iterator
-          j = found.rbegin(); j != found.rend(); ++j)
-    {
-      if (rule_applies_to_file(*j, *i))
-      {
-        install_file = (*j).action;
-        break;
-      }
-    }
+    const rule_t* rule = decide_rule(found, *i);
 
-    if (install_file)
+    if (!rule || rule->action)
       install_set.insert(install_set.end(), *i);
     else
       non_install_set.insert(*i);
@@ -182,6 +218,7 @@ pkgadd::read_config(const string& file)
           rule_t rule;
           rule.event = strcmp(event, "UPGRADE") ? INSTALL : UPGRADE;
           rule.pattern = pattern;
+          rule.line = linecount;
 
           if (!strcmp(action, "YES"))
           {
@@ -223,19 +260,174 @@ pkgadd::read_config(const string& file)
   return rules;
 }
 
+void
+pkgadd::print_explanation(const set<string>&     files,
+                          const vector<rule_t>&  rules)
+  const
+{
+  vector<rule_t> install, upgrade;
+
+  find_rules(rules, INSTALL, install);
+  find_rules(rules, UPGRADE, upgrade);
+
+  /*
+   * Deciding rule of each file and event.  Without one, a file is
+   * installed and overwritten on upgrade, i.e. the action is YES.
+   */
+  for (set<string>::const_iterator
+        i = files.begin(); i != files.end(); ++i)
+  {
+    const rule_t* event[2] = { decide_rule(install, *i),
+                               decide_rule(upgrade, *i) };
+
+    cout << *i;
+
+    for (int j = 0; j < 2; ++j)
+    {
+      cout << (j ? ", UPGRADE " : ": INSTALL ");
+
+      if (event[j])
+        cout << (event[j]->action ? "YES" : "NO") << " (line "
+             << event[j]->line << ": " << event[j]->pattern << ")";
+      else
+        cout << "YES (default)";
+    }
+
+    cout << '\n';
+  }
+
+  /*
+   * Statistics of each rule, in the order of the configuration.
+   */
+  if (rules.empty())
+    return;
+
+  cout << "\n  line event   action evaluated  matched      won"
+       << "      time pattern\n";
+
+  for (vector<rule_t>::const_iterator
+        i = rules.begin(); i != rules.end(); ++i)
+  {
+    const rule_stats_t& stats = rule_stats[i->line];
+    char                buf[128];
+
+    snprintf(buf, sizeof(buf), "%6u %-7s %-6s %9zu %8zu %8zu %7.2fms ",
+             i->line, i->event == UPGRADE ? "UPGRADE" : "INSTALL",
+             i->action ? "YES" : "NO", stats.evaluated, stats.matched,
+             stats.won, stats.ns / 1e6);
+
+    cout << buf << i->pattern << '\n';
+  }
+}
+
+void
+pkgadd::print_plan(const pair<string, pkginfo_t>&  package,
+                   const set<string>&              non_install_files,
+                   const set<string>&              conflicting_files,
+                   const set<string>&              keep_list,
+                   bool                            upgrade,
+                   bool                            force)
+  const
+{
+  /*
+   * Files of the package to install.
+   */
+  for (set<string>::const_iterator
+        i = package.second.files.begin();
+        i != package.second.files.end();
+        ++i)
+  {
+    const bool exists = file_exists(root + *i);
+
+    if (   !force
+        && conflicting_files.find(*i) != conflicting_files.end())
+      cout << "conflict ";
+    else if (!exists)
+      cout << "add      ";
+    else if ((*i)[i->length() - 1] == '/')
+      continue; /* Existing directory. */
+    else if (keep_list.find(*i) != keep_list.end())
+      cout << "reject   ";
+    else
+      cout << "replace  ";
+
+    cout << *i << '\n';
+  }
+
+  /*
+   * Files filtered out via INSTALL.
+   */
+  for (set<string>::const_iterator
+        i = non_install_files.begin(); i != non_install_files.end(); ++i)
+  {
+    cout << "ignore   " << *i << '\n';
+  }
+
+  /*
+   * Files of the old version that are not shipped anymore.
+   */
+  packages_t::const_iterator old = packages.find(package.first);
+
+  if (upgrade && old != packages.end())
+  {
+    set<string> files;
+
+    set_difference(old->second.files.begin(), old->second.files.end(),
+                   package.second.files.begin(), package.second.files.end(),
+                   inserter(files, files.end()));
+
+    for (set<string>::const_iterator
+          i = keep_list.begin(); i != keep_list.end(); ++i)
+    {
+      files.erase(*i);
+    }
+
+    for (packages_t::const_iterator
+          i = packages.begin(); i != packages.end(); ++i)
+    {
+      if (i == old)
+        continue;
+
+      for (set<string>::const_iterator
+            j = i->second.files.begin(); j != i->second.files.end(); ++j)
+      {
+        files.erase(*j);
+      }
+    }
+
+    for (set<string>::const_iterator
+          i = files.begin(); i != files.end(); ++i)
+    {
+      if (file_exists(root + *i))
+        cout << "delete   " << *i << '\n';
+    }
+  }
+
+  cout.flush();
+
+  if (!conflicting_files.empty() && !force)
+    throw runtime_error("listed file(s) already installed "
+                        "(use -f to ignore and overwrite)");
+}
+
 void
 pkgadd::print_help()
   const
 {
-  cout << R"(Usage: pkgadd [-Vfhuv] [-c conffile] [-r rootdir] file
+  cout << R"(Usage: pkgadd [-Vefhnuv] [-c conffile] [-j jobs] [-r rootdir] file
 Install software package.
 
 Mandatory arguments to long options are mandatory for short options too.
   -c, --config=conffile  specify an alternate configuration file
+  -e, --explain          show the rule deciding each file and the
+                         cost of each rule, change nothing
   -f, --force            force install, overwrite conflicting files
+  -j, --jobs=jobs        use jobs threads, 0 for the available CPUs
+  -n, --dry-run          show what would be done, change nothing
   -r, --root=rootdir     specify an alternate root directory
   -u, --upgrade          upgrade package with the same name
-  -v, --verbose          explain what is being done
+  -v, --verbose          explain what is being done, twice to also
+                         print file operation latencies
   -V, --version          print version and exit
   -h, --help             print help and exit
 )";
@@ -247,12 +439,16 @@ pkgadd::run(int argc, char** argv)
   /*
    * Check command line options.
    */
-  static int o_upgrade = 0, o_force = 0, o_verbose = 0;
+  static int o_upgrade = 0, o_force = 0, o_verbose = 0, o_dry_run = 0;
+  static int o_explain = 0;
   static string o_root, o_config = PKGADD_CONF, o_package;
   int opt;
   static struct option longopts[] = {
     { "config",   required_argument,  NULL,           'c' },
+    { "explain",  no_argument,        NULL,           'e' },
     { "force",    no_argument,        NULL,           'f' },
+    { "jobs",     required_argument,  NULL,           'j' },
+    { "dry-run",  no_argument,        NULL,           'n' },
     { "root",     required_argument,  NULL,           'r' },
     { "upgrade",  no_argument,        NULL,           'u' },
     { "verbose",  no_argument,        NULL,           'v' },
@@ -261,15 +457,24 @@ pkgadd::run(int argc, char** argv)
     { 0,          0,                  0,              0   },
   };
 
-  while ((opt = getopt_long(argc, argv, "c:fr:uvVh", longopts, 0)) != -1)
+  while ((opt = getopt_long(argc, argv, "c:efj:nr:uvVh", longopts, 0)) != -1)
   {
     switch (opt) {
     case 'c':
       o_config = optarg;
       break;
+    case 'e':
+      o_explain = 1;
+      break;
     case 'f':
       o_force = 1;
       break;
+    case 'j':
+      set_jobs(optarg);
+      break;
+    case 'n':
+      o_dry_run = 1;
+      break;
     case 'r':
       o_root = optarg;
       break;
@@ -297,22 +502,83 @@ pkgadd::run(int argc, char** argv)
 
   o_package = argv[optind];
 
+  if (o_verbose > 1)
+    latency_enable();
+
+  /* explaining the rules changes nothing */
+  if (o_explain)
+  {
+    explain   = true;
+    o_dry_run = 1;
+  }
+
   /*
    * Check UID.
    */
-  if (getuid())
+  if (getuid() && !o_dry_run)
     throw runtime_error("only root can install/upgrade packages");
 
   /*
    * Install or upgrade package.
    */
+  if (!o_dry_run)
   {
-    db_lock lock(o_root, true);
+    char path[PATH_MAX];
+
+    tx_begin(o_upgrade ? "upgrade" : "install", o_root);
+    tx->file = realpath(o_package.c_str(), path) ? path : o_package;
+  }
+
+  try
+  {
+    if (tx)
+      tx->package = pkg_name(o_package).first;
+
+    db_exclusive = !o_dry_run;
+    db_lock lock(o_root, db_exclusive);
+    tx_phase("open");
     db_open(o_root);
 
-    pair<string, pkginfo_t> package      = pkg_open(o_package);
+    /*
+     * Upgrading to the very same package file is a no-op, unless
+     * forced or explained.  The package file is only hashed if the
+     * installed version is the same and its identity is known.
+     */
+    string                     identity;
+    pair<string, string>       name     = pkg_name(o_package);
+    packages_t::const_iterator current  = packages.find(name.first);
+
+    if (   o_upgrade && !o_force && !o_explain
+        && current != packages.end()
+        && current->second.version == name.second
+        && !current->second.identity.empty())
+    {
+      identity = file_digest(o_package);
+
+      if (current->second.identity == identity)
+      {
+        if (o_verbose)
+          cout << "package " << name.first << " is up to date" << endl;
+
+        if (tx)
+          tx->old_version = current->second.version;
+        tx_end("unchanged");
+        return;
+      }
+    }
+
+    tx_phase("read");
+
+    manifest_t              manifest;
+    pair<string, pkginfo_t> package      = pkg_open(o_package, &manifest);
     vector<rule_t>          config_rules = read_config(o_config);
 
+    if (o_explain)
+    {
+      print_explanation(package.second.files, config_rules);
+      return;
+    }
+
     bool installed = db_find_pkg(package.first);
 
     if (installed && !o_upgrade)
@@ -323,24 +589,66 @@ pkgadd::run(int argc, char** argv)
       throw runtime_error("package " + package.first +
                           " not previously installed (skip -u to install)");
 
+    tx_phase("conflicts");
+
     set<string> non_install_files =
       apply_install_rules(package.first, package.second, config_rules);
 
     set<string> conflicting_files =
       db_find_conflicts(package.first, package.second);
 
+    set<string> keep_list;
+
+    if (o_upgrade)
+      keep_list = make_keep_list(package.second.files, config_rules);
+
+    if (o_dry_run)
+    {
+      print_plan(package, non_install_files, conflicting_files,
+                 keep_list, o_upgrade, o_force);
+      pkg_check_space(package.second, manifest, keep_list);
+      latency_report();
+      return;
+    }
+
+    /*
+     * Fail before anything is touched if the package doesn't fit.
+     */
+    pkg_check_space(package.second, manifest, keep_list);
+
+    tx->new_version = package.second.version;
+
+    if (installed)
+    {
+      const pkginfo_t& old = packages[package.first];
+
+      tx->old_version = old.version;
+      for (set<string>::const_iterator
+            i = package.second.files.begin();
+            i != package.second.files.end(); ++i)
+      {
+        if (old.files.find(*i) == old.files.end())
+          ++tx->added;
+      }
+    }
+    else
+      tx->added = package.second.files.size();
+
+    tx_phase("remove");
+
     if (!conflicting_files.empty())
     {
       if (o_force)
       {
-        set<string> keep_list;
+        set<string> conflict_keep_list;
         if (o_upgrade)
         {
           /* don't remove files matching the rules in configuration */
-          keep_list = make_keep_list(conflicting_files, config_rules);
+          conflict_keep_list =
+            make_keep_list(conflicting_files, config_rules);
         }
         /* remove unwanted conflicts */
-        db_rm_files(conflicting_files, keep_list);
+        db_rm_files(conflicting_files, conflict_keep_list);
       }
       else
       {
@@ -352,23 +660,38 @@ pkgadd::run(int argc, char** argv)
       }
     }
 
-    set<string> keep_list;
-
     if (o_upgrade)
     {
-      keep_list = make_keep_list(package.second.files, config_rules);
-      db_rm_pkg(package.first, keep_list);
+      /* files shipped again are replaced in place by pkg_install(),
+       * so that unchanged ones don't have to be rewritten */
+      set<string> rm_keep_list = keep_list;
+      rm_keep_list.insert(package.second.files.begin(),
+                          package.second.files.end());
+      db_rm_pkg(package.first, rm_keep_list);
     }
 
+    tx_phase("commit");
+
+    if (identity.empty())
+      identity = file_digest(o_package);
+
+    /* the identity is recorded once all files are in place, so that
+     * a failed upgrade can be repeated with the same package file */
     db_add_pkg(package.first, package.second);
     db_commit();
+
+    tx_phase("extract");
+
+    bool complete = false;
+
     try
     {
       if (o_verbose)
         cout << (o_upgrade ? "upgrading " : "installing ")
              << package.first << endl;
 
-      pkg_install(o_package, keep_list, non_install_files, installed);
+      complete = pkg_install(o_package, manifest, keep_list,
+                             non_install_files, installed);
     }
     catch (runtime_error&)
     {
@@ -379,7 +702,26 @@ pkgadd::run(int argc, char** argv)
         throw runtime_error("failed");
       }
     }
+
+    if (complete)
+    {
+      packages[package.first].identity = identity;
+      db_write_indexes();
+    }
+    tx_phase("ldconfig");
     ldconfig();
+    latency_report();
+    tx_end("ok");
+  }
+  catch (const db_locked_error& e)
+  {
+    tx_end("locked", e.what());
+    throw;
+  }
+  catch (const exception& e)
+  {
+    tx_end("error", e.what());
+    throw;
   }
 }
 
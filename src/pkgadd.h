@@ -6,6 +6,8 @@
 
 #include <vector>
 #include <set>
+#include <map>
+#include <cstdint>
 
 #include <getopt.h>
 
@@ -21,12 +23,23 @@ struct rule_t {
   rule_event_t  event;
   string        pattern;
   bool          action;
+  unsigned int  line;       /* of the configuration file */
+};
+
+/* evaluation of a rule, counted by --explain */
+struct rule_stats_t {
+  rule_stats_t() : evaluated(0), matched(0), won(0), ns(0) {}
+
+  size_t        evaluated;  /* files tested until one rule applied */
+  size_t        matched;    /* files it applies to, shadowed or not */
+  size_t        won;        /* files it decided */
+  uint64_t      ns;         /* time of the evaluations */
 };
 
 class pkgadd : public pkgutil
 {
 public:
-  pkgadd() : pkgutil("pkgadd") {}
+  pkgadd() : pkgutil("pkgadd"), explain(false) {}
 
   virtual void run(int argc, char** argv) override;
   virtual void print_help() const override;
@@ -47,6 +60,24 @@ private:
 
   bool rule_applies_to_file(const rule_t&  rule,
                             const string&  file) const;
+
+  const rule_t* decide_rule(const vector<rule_t>&  found,
+                            const string&          file) const;
+
+  void print_explanation(const set<string>&     files,
+                         const vector<rule_t>&  rules) const;
+
+  void print_plan(const pair<string, pkginfo_t>&  package,
+                  const set<string>&              non_install_files,
+                  const set<string>&              conflicting_files,
+                  const set<string>&              keep_list,
+                  bool                            upgrade,
+                  bool                            force) const;
+
+  /* statistics of the rules are kept, by line */
+  bool explain;
+
+  mutable map<unsigned int, rule_stats_t> rule_stats;
 }; // class pkgadd
 
 // vim: sw=2 ts=2 sts=2 et cc=72 tw=70
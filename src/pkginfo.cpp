@@ -3,10 +3,25 @@
 //!        See COPYING and COPYRIGHT files for corresponding information.
 
 #include <iterator>
+#include <fstream>
 #include <vector>
+#include <algorithm>
+#include <unordered_set>
+#include <mutex>
 #include <iomanip>
+#include <csignal>
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#include <linux/magic.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
 #include <regex.h>
 
 #include "pkginfo.h"
@@ -15,47 +30,111 @@ void
 pkginfo::print_help()
   const
 {
-  cout << R"(Usage: pkginfo [-Vh] [-r rootdir]
-               {-f file | -i | -l <pkgname | file> | -o pattern}
+  cout << R"(Usage: pkginfo [-Vh] [-j jobs] [-r rootdir]
+               {-c | -f file | -i | -k[k] | -l <pkgname | file> |
+                -o pattern | -p pattern [dir] | -s [pkgname] | -t | -u}
 Display software package information.
 
 Mandatory arguments to long options are mandatory for short options too.
+  -c, --changes                list package files changed since last time
   -f, --footprint=file         print footprint for file
   -i, --installed              list installed packages and their version
+  -j, --jobs=jobs              use jobs threads, 0 for the available CPUs
+  -k, --check                  check the package database, given twice
+                               check the package files on disk too
   -l, --list=<pkgname | file>  list files in package or file
   -o, --owner=pattern          list owner(s) of file(s) matching pattern
+  -p, --provides=pattern       list package files in directory
+                               containing file(s) matching pattern
   -r, --root=rootdir           specify an alternate root directory
+  -s, --size                   list disk usage of installed packages
+  -t, --track                  record changes of package files
+  -u, --unowned                list files not owned by any package
   -V, --version                print version and exit
   -h, --help                   print help and exit
 )";
 }
 
+/*
+ * Check whether a regular expression matches a single path, like
+ * "^/usr/bin/foo$", and return the path as recorded in the database.
+ */
+static bool
+literal_path(const string& pattern, string& path)
+{
+  if (   pattern.length() < 4
+      || pattern.compare(0, 2, "^/") != 0
+      || pattern[pattern.length() - 1] != '$')
+    return false;
+
+  path.clear();
+
+  for (size_t i = 2; i < pattern.length() - 1; ++i)
+  {
+    char c = pattern[i];
+
+    if (c == '\\')
+    {
+      if (++i == pattern.length() - 1 ||
+          !strchr(".[]()*+?{}|^$\\", pattern[i]))
+        return false;
+      c = pattern[i];
+    }
+    else if (strchr(".[]()*+?{}|^$", c))
+    {
+      return false;
+    }
+
+    path += c;
+  }
+
+  return true;
+}
+
 void
 pkginfo::run(int argc, char** argv)
 {
   /*
    * Check command line options.
    */
+  static int o_changes_mode   = 0;
+  static int o_check_mode     = 0;
+  static int o_check_disk     = 0;
   static int o_footprint_mode = 0;
   static int o_installed_mode = 0;
   static int o_list_mode      = 0;
   static int o_owner_mode     = 0;
+  static int o_provides_mode  = 0;
+  static int o_size_mode      = 0;
+  static int o_track_mode     = 0;
+  static int o_unowned_mode   = 0;
   static string o_root;
   static string o_arg;
   int opt;
   static struct option longopts[] = {
+    { "changes",    no_argument,        NULL,  'c' },
     { "footprint",  required_argument,  NULL,  'f' },
+    { "check",      no_argument,        NULL,  'k' },
     { "installed",  no_argument,        NULL,  'i' },
+    { "jobs",       required_argument,  NULL,  'j' },
     { "list",       required_argument,  NULL,  'l' },
     { "owner",      required_argument,  NULL,  'o' },
+    { "provides",   required_argument,  NULL,  'p' },
     { "root",       required_argument,  NULL,  'r' },
+    { "size",       no_argument,        NULL,  's' },
+    { "track",      no_argument,        NULL,  't' },
+    { "unowned",    no_argument,        NULL,  'u' },
     { "version",    no_argument,        NULL,  'V' },
     { "help",       no_argument,        NULL,  'h' },
+    { 0,            0,                  0,     0   },
   };
 
-  while ((opt = getopt_long(argc, argv, "f:il:o:r:Vh", longopts, 0)) != -1)
+  while ((opt = getopt_long(argc, argv, "cf:ij:kl:o:p:r:stuVh", longopts, 0)) != -1)
   {
     switch (opt) {
+    case 'c':
+      o_changes_mode = 1;
+      break;
     case 'f':
       o_footprint_mode = 1;
       o_arg = optarg;
@@ -63,6 +142,14 @@ pkginfo::run(int argc, char** argv)
     case 'i':
       o_installed_mode = 1;
       break;
+    case 'j':
+      set_jobs(optarg);
+      break;
+    case 'k':
+      /* given twice, check the files on disk too */
+      o_check_disk = o_check_mode;
+      o_check_mode = 1;
+      break;
     case 'l':
       o_list_mode = 1;
       o_arg = optarg;
@@ -71,9 +158,22 @@ pkginfo::run(int argc, char** argv)
       o_owner_mode = 1;
       o_arg = optarg;
       break;
+    case 'p':
+      o_provides_mode = 1;
+      o_arg = optarg;
+      break;
     case 'r':
       o_root = optarg;
       break;
+    case 's':
+      o_size_mode = 1;
+      break;
+    case 't':
+      o_track_mode = 1;
+      break;
+    case 'u':
+      o_unowned_mode = 1;
+      break;
     case 'V':
       return print_version();
     case 'h':
@@ -85,12 +185,21 @@ pkginfo::run(int argc, char** argv)
     }
   }
 
-  if (o_footprint_mode + o_installed_mode + o_list_mode + o_owner_mode == 0)
+  int modes = o_changes_mode + o_check_mode + o_footprint_mode
+            + o_installed_mode
+            + o_list_mode + o_owner_mode + o_provides_mode + o_size_mode
+            + o_track_mode + o_unowned_mode;
+
+  if (modes == 0)
     throw invalid_argument("option missing");
 
-  if (o_footprint_mode + o_installed_mode + o_list_mode + o_owner_mode > 1)
+  if (modes > 1)
     throw invalid_argument("too many options");
 
+  if (   optind < argc
+      && ((!o_size_mode && !o_provides_mode) || argc - optind > 1))
+    throw invalid_argument("too many arguments");
+
   if (o_footprint_mode)
   {
     /*
@@ -98,6 +207,25 @@ pkginfo::run(int argc, char** argv)
      */
     pkg_footprint(o_arg);
   }
+  else if (o_provides_mode)
+  {
+    /*
+     * List package files providing file(s).
+     */
+    print_providers(o_arg, optind < argc ? argv[optind] : PKG_REPO);
+  }
+  else if (o_check_mode)
+  {
+    /*
+     * Check database consistency.
+     */
+    db_lock lock(o_root, false);
+
+    size_t problems = db_check(o_root, o_check_disk, false);
+    if (problems)
+      throw runtime_error(to_string(problems) +
+                          " problem(s) found in the package database");
+  }
   else
   {
     /*
@@ -105,7 +233,30 @@ pkginfo::run(int argc, char** argv)
      */
     {
       db_lock lock(o_root, false);
-      db_open(o_root);
+
+      /* listing the installed packages doesn't need the file lists,
+       * listing a package or the owners of a file may not need all of
+       * them, depending on the backend */
+      string file;
+
+      if (o_installed_mode)
+      {
+        if (!db_open_names(o_root))
+          db_open(o_root);
+      }
+      else if (o_list_mode)
+      {
+        if (!db_open_pkg(o_root, o_arg))
+          db_open(o_root);
+      }
+      else if (o_owner_mode && literal_path(o_arg, file))
+      {
+        /* the owners of a single file may be looked up directly */
+        if (!db_open_owner(o_root, file))
+          db_open(o_root);
+      }
+      else
+        db_open(o_root);
     }
 
     if (o_installed_mode)
@@ -119,6 +270,34 @@ pkginfo::run(int argc, char** argv)
         cout << i->first << ' ' << i->second.version << endl;
       }
     }
+    else if (o_size_mode)
+    {
+      /*
+       * List disk usage of package(s).
+       */
+      print_sizes(optind < argc ? argv[optind] : "");
+    }
+    else if (o_track_mode)
+    {
+      /*
+       * Record changes of package files until terminated.
+       */
+      track();
+    }
+    else if (o_changes_mode)
+    {
+      /*
+       * List package files changed since the last run.
+       */
+      print_changes();
+    }
+    else if (o_unowned_mode)
+    {
+      /*
+       * List files not owned by any package.
+       */
+      print_unowned();
+    }
     else if (o_list_mode)
     {
       /*
@@ -195,5 +374,831 @@ pkginfo::run(int argc, char** argv)
   }
 }
 
+void
+pkginfo::print_sizes(const string& name)
+{
+  struct file_t
+  {
+    size_t        pkg;
+    const string* path;
+    dev_t         dev;
+    ino_t         ino;
+    off_t         bytes;
+  };
+
+  struct inode_hash
+  {
+    size_t operator()(const pair<dev_t, ino_t>& i) const
+    {
+      return hash<ino_t>()(i.second) ^ (hash<dev_t>()(i.first) << 1);
+    }
+  };
+
+  vector<packages_t::const_iterator> pkgs;
+  vector<file_t>                     files;
+
+  if (name.empty())
+  {
+    for (packages_t::const_iterator
+          i = packages.begin(); i != packages.end(); ++i)
+    {
+      pkgs.push_back(i);
+    }
+  }
+  else if (db_find_pkg(name))
+    pkgs.push_back(packages.find(name));
+  else
+    throw runtime_error("package " + name + " not installed");
+
+  for (size_t i = 0; i < pkgs.size(); ++i)
+  {
+    for (set<string>::const_iterator
+          j = pkgs[i]->second.files.begin();
+          j != pkgs[i]->second.files.end();
+          ++j)
+    {
+      file_t file = { i, &*j, 0, 0, -1 };
+      files.push_back(file);
+    }
+  }
+
+  int rootfd = open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (rootfd == -1)
+    throw runtime_error_with_errno("could not open " + root);
+
+  /*
+   * Stat all files in parallel.  Files of a package are sorted, so
+   * consecutive ones mostly share the directory descriptor.
+   */
+  parallel_for(files.size(), [&](size_t begin, size_t end)
+  {
+    string dir;
+    int    dirfd = -1;
+
+    for (size_t i = begin; i < end; ++i)
+    {
+      const string&     path  = *files[i].path;
+      string::size_type slash = path.rfind('/', path.length() - 2);
+      string            base;
+
+      if (slash == string::npos)
+        slash = 0;
+      else
+        ++slash;
+
+      if (dirfd == -1 || path.compare(0, slash, dir))
+      {
+        if (dirfd != -1)
+          close(dirfd);
+
+        dir   = path.substr(0, slash);
+        dirfd = openat(rootfd, dir.empty() ? "." : dir.c_str(),
+                       O_PATH | O_DIRECTORY | O_CLOEXEC);
+      }
+
+      base = path.substr(slash);
+      if (base[base.length() - 1] == '/')
+        base.erase(base.length() - 1);
+
+      struct stat st;
+      if (   dirfd != -1
+          && fstatat(dirfd, base.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0)
+      {
+        files[i].dev   = st.st_dev;
+        files[i].ino   = st.st_ino;
+        files[i].bytes = st.st_blocks * 512;
+      }
+    }
+
+    if (dirfd != -1)
+      close(dirfd);
+  });
+
+  close(rootfd);
+
+  /*
+   * Sum up, counting hardlinks and directories shared between
+   * packages only once.
+   */
+  vector<pair<off_t, string>>              sizes(pkgs.size());
+  unordered_set<pair<dev_t, ino_t>, inode_hash> seen;
+
+  for (size_t i = 0; i < pkgs.size(); ++i)
+    sizes[i] = make_pair(0, pkgs[i]->first);
+
+  for (size_t i = 0; i < files.size(); ++i)
+  {
+    if (   files[i].bytes >= 0
+        && seen.insert(make_pair(files[i].dev, files[i].ino)).second)
+    {
+      sizes[files[i].pkg].first += files[i].bytes;
+    }
+  }
+
+  sort(sizes.begin(), sizes.end(),
+      [](const pair<off_t, string>& a, const pair<off_t, string>& b)
+      {
+        return a.first != b.first ? a.first > b.first
+                                  : a.second < b.second;
+      });
+
+  for (size_t i = 0; i < sizes.size(); ++i)
+    cout << sizes[i].first / 1024 << '\t' << sizes[i].second << '\n';
+}
+
+/*
+ * Filesystems that are not worth looking into when mounted below the
+ * root directory.
+ */
+static bool
+is_volatile_fs(int fd)
+{
+  struct statfs buf;
+
+  if (fstatfs(fd, &buf) == -1)
+    return false;
+
+  switch (buf.f_type)
+  {
+    case PROC_SUPER_MAGIC:
+    case SYSFS_MAGIC:
+    case TMPFS_MAGIC:
+    case DEVPTS_SUPER_MAGIC:
+    case CGROUP_SUPER_MAGIC:
+    case CGROUP2_SUPER_MAGIC:
+    case DEBUGFS_MAGIC:
+    case TRACEFS_MAGIC:
+    case SECURITYFS_MAGIC:
+    case SELINUX_MAGIC:
+    case PSTOREFS_MAGIC:
+    case EFIVARFS_MAGIC:
+    case BPF_FS_MAGIC:
+    case BINFMTFS_MAGIC:
+    case HUGETLBFS_MAGIC:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void
+pkginfo::print_unowned()
+{
+  struct linux_dirent64
+  {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[256];
+  };
+
+  unordered_set<string> owned;
+  vector<string>        unowned;
+  mutex                 lock;
+
+  for (packages_t::const_iterator
+        i = packages.begin(); i != packages.end(); ++i)
+  {
+    owned.insert(i->second.files.begin(), i->second.files.end());
+  }
+
+  int rootfd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (rootfd == -1)
+    throw runtime_error_with_errno("could not open " + root);
+
+  /*
+   * Walk the tree level by level, reading the directories of each level
+   * in parallel.  Directories nobody owns are reported as a whole
+   * without descending into them.
+   */
+  vector<string> level(1, "");
+
+  while (!level.empty())
+  {
+    vector<string> next;
+
+    parallel_for(level.size(), [&](size_t begin, size_t end)
+    {
+      vector<string> found;
+      vector<string> subdirs;
+      char           buf[64 * 1024];
+
+      for (size_t i = begin; i < end; ++i)
+      {
+        const string& dir = level[i];
+        int fd = openat(rootfd, dir.empty() ? "." : dir.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1)
+          continue;
+
+        struct stat dirst;
+        fstat(fd, &dirst);
+
+        long n;
+        while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+        {
+          for (long pos = 0; pos < n; )
+          {
+            linux_dirent64* d = reinterpret_cast<linux_dirent64*>(buf + pos);
+            pos += d->d_reclen;
+
+            if (   !strcmp(d->d_name, ".")
+                || !strcmp(d->d_name, ".."))
+              continue;
+
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN)
+            {
+              struct stat st;
+              if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                continue;
+              type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+
+            string path = dir + d->d_name;
+            if (type == DT_DIR)
+              path += '/';
+
+            if (owned.find(path) == owned.end())
+              found.push_back(path);
+            else if (type == DT_DIR)
+            {
+              /*
+               * Prune mount points of virtual filesystems.
+               */
+              struct stat st;
+              if (   fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                  && st.st_dev != dirst.st_dev)
+              {
+                int subfd = openat(fd, d->d_name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                bool skip = subfd == -1 || is_volatile_fs(subfd);
+
+                if (subfd != -1)
+                  close(subfd);
+                if (skip)
+                  continue;
+              }
+              subdirs.push_back(path);
+            }
+          }
+        }
+
+        close(fd);
+      }
+
+      lock_guard<mutex> guard(lock);
+      unowned.insert(unowned.end(), found.begin(), found.end());
+      next.insert(next.end(), subdirs.begin(), subdirs.end());
+    });
+
+    level.swap(next);
+  }
+
+  close(rootfd);
+
+  sort(unowned.begin(), unowned.end());
+  copy(unowned.begin(), unowned.end(),
+       ostream_iterator<string>(cout, "\n"));
+}
+
+/*
+ * Events recorded for watched directories.
+ */
+#define TRACK_EVENTS  (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE      \
+                     | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR            \
+                     | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+/*
+ * Milliseconds between attempts to reload a locked database.
+ */
+#define TRACK_RETRY   100
+
+void
+pkginfo::track()
+{
+  /*
+   * Unlike the other modes, the tracker is meant to be stopped by a
+   * signal.
+   */
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_DFL;
+  sigaction(SIGHUP,  &sa, 0);
+  sigaction(SIGINT,  &sa, 0);
+  sigaction(SIGQUIT, &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+
+  const string logname = root + PKG_CHANGES;
+  const string pkgdir  = string(PKG_DIR) + "/";
+
+  int logfd = open(logname.c_str(),
+                   O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (logfd == -1)
+    throw runtime_error_with_errno("could not open " + logname);
+
+  unordered_set<string> logged;
+  off_t                 logsize = 0;
+
+  /*
+   * The inotify instance is kept across reloads of the database, so
+   * that no events get lost in between.
+   */
+  unordered_set<string> owned;
+  map<int, string>      watches;
+
+  int ifd = inotify_init1(IN_CLOEXEC);
+  if (ifd == -1)
+    throw runtime_error_with_errno("could not initialize inotify");
+
+  /*
+   * pkgadd keeps the database locked after moving a new one into
+   * place, until the package is extracted.  Instead of failing like
+   * db_lock, the reload is put off until a shared lock of the
+   * database directory can be taken, while events are still read.
+   */
+  const string lockname = trim_filename(root + "/" + PKG_DIR);
+
+  int lockfd = open(lockname.c_str(),
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (lockfd == -1)
+    throw runtime_error_with_errno("could not read directory " +
+                                   lockname);
+
+  bool reload = false;
+
+  for (;;)
+  {
+    /*
+     * Watch the root, the package database directory and every
+     * directory owned by a package.  Directories no longer owned by
+     * any package are not watched anymore.
+     */
+    set<string> dirs;
+    dirs.insert("");
+    dirs.insert(pkgdir);
+
+    owned.clear();
+
+    for (packages_t::const_iterator
+          i = packages.begin(); i != packages.end(); ++i)
+    {
+      owned.insert(i->second.files.begin(), i->second.files.end());
+
+      for (set<string>::const_iterator
+            j = i->second.files.begin(); j != i->second.files.end(); ++j)
+      {
+        if ((*j)[j->length() - 1] == '/')
+          dirs.insert(*j);
+      }
+    }
+
+    for (map<int, string>::iterator i = watches.begin();
+          i != watches.end(); )
+    {
+      if (dirs.find(i->second) == dirs.end())
+      {
+        inotify_rm_watch(ifd, i->first);
+        watches.erase(i++);
+      }
+      else
+        ++i;
+    }
+
+    for (set<string>::const_iterator
+          i = dirs.begin(); i != dirs.end(); ++i)
+    {
+      int wd = inotify_add_watch(ifd, (root + *i).c_str(),
+                                 TRACK_EVENTS);
+      if (wd != -1)
+        watches[wd] = *i;
+      else if (errno == ENOSPC)
+        throw runtime_error_with_errno("could not watch " + root +
+            *i + " (see fs.inotify.max_user_watches)");
+    }
+
+    /*
+     * Record events until the database is replaced and can be read.
+     */
+    for (;;)
+    {
+      if (reload)
+      {
+        if (flock(lockfd, LOCK_SH | LOCK_NB) == 0)
+          break;
+        if (errno != EWOULDBLOCK)
+          throw runtime_error_with_errno("could not lock directory " +
+                                         lockname);
+      }
+
+      /*
+       * Retry a pending reload every TRACK_RETRY milliseconds.
+       */
+      struct pollfd pfd = { ifd, POLLIN, 0 };
+      int ready = poll(&pfd, 1, reload ? TRACK_RETRY : -1);
+
+      if (ready == -1 && errno != EINTR)
+        throw runtime_error_with_errno("could not read inotify events");
+      if (ready <= 0)
+        continue;
+
+      char    buf[64 * 1024]
+                __attribute__ ((aligned(__alignof__(struct inotify_event))));
+      ssize_t n = read(ifd, buf, sizeof(buf));
+
+      if (n == -1)
+      {
+        if (errno == EINTR)
+          continue;
+        throw runtime_error_with_errno("could not read inotify events");
+      }
+
+      vector<string> batch;
+
+      for (char* p = buf; p < buf + n; )
+      {
+        const struct inotify_event* ev =
+          reinterpret_cast<struct inotify_event*>(p);
+        p += sizeof(struct inotify_event) + ev->len;
+
+        if (ev->mask & IN_Q_OVERFLOW)
+        {
+          batch.push_back("!");
+          continue;
+        }
+
+        if (ev->mask & IN_IGNORED)
+        {
+          watches.erase(ev->wd);
+          continue;
+        }
+
+        map<int, string>::const_iterator dir = watches.find(ev->wd);
+        if (!ev->len || dir == watches.end())
+          continue;
+
+        if (dir->second == pkgdir)
+        {
+          /* the database itself is not tracked, it is reloaded
+           * when pkgadd or pkgrm moved a new one into place; the
+           * names index is replaced last on every commit */
+          if (   (!strcmp(ev->name, "db") || !strcmp(ev->name, "db.names"))
+              && (ev->mask & IN_MOVED_TO))
+            reload = true;
+          continue;
+        }
+
+        string path = dir->second + ev->name;
+        if (ev->mask & IN_ISDIR)
+          path += '/';
+
+        if (owned.find(path) != owned.end())
+        {
+          batch.push_back(
+              (ev->mask & (IN_DELETE | IN_MOVED_FROM) ? "D " : "M ")
+              + path);
+
+          /* owned directory (re)created, e.g. by pkgadd */
+          if (   (ev->mask & IN_ISDIR)
+              && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+          {
+            int wd = inotify_add_watch(ifd, (root + path).c_str(),
+                                       TRACK_EVENTS);
+            if (wd != -1)
+              watches[wd] = path;
+          }
+        }
+        else if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+        {
+          batch.push_back("N " + path);
+        }
+      }
+
+      if (batch.empty())
+        continue;
+
+      /*
+       * Append what was not logged yet.  The log is truncated by
+       * pkginfo --changes, under the same lock.
+       */
+      flock(logfd, LOCK_EX);
+
+      struct stat st;
+      bool        sized = fstat(logfd, &st) == 0;
+
+      if (sized && st.st_size < logsize)
+        logged.clear();
+
+      string out;
+      for (size_t i = 0; i < batch.size(); ++i)
+      {
+        if (logged.insert(batch[i]).second)
+          out += batch[i] + '\n';
+      }
+
+      if (!out.empty() && write(logfd, out.data(), out.size()) == -1)
+      {
+        const char* msg = strerror(errno);
+        cerr << utilname << ": could not write " << logname << ": "
+             << msg << endl;
+      }
+
+      if (sized)
+        logsize = st.st_size + out.size();
+      flock(logfd, LOCK_UN);
+    }
+
+    packages.clear();
+    db_open(root);
+
+    flock(lockfd, LOCK_UN);
+    reload = false;
+  }
+}
+
+void
+pkginfo::print_changes()
+{
+  const string logname = root + PKG_CHANGES;
+
+  /*
+   * The log is consumed, unless we may only read it.
+   */
+  bool consume = true;
+  int  fd      = open(logname.c_str(), O_RDWR | O_CLOEXEC);
+
+  if (fd == -1 && errno == EACCES)
+  {
+    consume = false;
+    fd = open(logname.c_str(), O_RDONLY | O_CLOEXEC);
+  }
+
+  if (fd == -1)
+    throw runtime_error_with_errno("could not open " + logname);
+
+  flock(fd, consume ? LOCK_EX : LOCK_SH);
+
+  string  log;
+  char    buf[64 * 1024];
+  ssize_t n;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    log.append(buf, n);
+
+  if (n == -1)
+    throw runtime_error_with_errno("could not read " + logname);
+
+  if (consume && ftruncate(fd, 0) == -1)
+    throw runtime_error_with_errno("could not truncate " + logname);
+
+  flock(fd, LOCK_UN);
+  close(fd);
+
+  /*
+   * Re-check the logged paths.
+   */
+  set<string> paths;
+  bool        overflow = false;
+
+  for (string::size_type pos = 0, end;
+        (end = log.find('\n', pos)) != string::npos; pos = end + 1)
+  {
+    if (log[pos] == '!')
+      overflow = true;
+    else if (end - pos > 2)
+      paths.insert(log.substr(pos + 2, end - pos - 2));
+  }
+
+  for (set<string>::const_iterator
+        i = paths.begin(); i != paths.end(); ++i)
+  {
+    const string* owner = 0;
+
+    for (packages_t::const_iterator
+          j = packages.begin(); j != packages.end() && !owner; ++j)
+    {
+      if (j->second.files.find(*i) != j->second.files.end())
+        owner = &j->first;
+    }
+
+    bool exists = file_exists(root + *i);
+
+    if (owner)
+      cout << (exists ? "modified " : "deleted  ") << *owner;
+    else if (exists)
+      cout << "unowned  -";
+    else
+      continue;
+
+    cout << ' ' << *i << '\n';
+  }
+
+  if (overflow)
+    cerr << utilname << ": events were lost, "
+         << "some changes may not be listed" << endl;
+}
+
+void
+pkginfo::print_providers(const string& pattern, const string& dir)
+  const
+{
+  /*
+   * Index record of a package file: its identity on disk and the
+   * files it contains.
+   */
+  struct entry_t
+  {
+    string      identity;
+    set<string> files;
+    string      error;
+  };
+
+  typedef map<string, entry_t> index_t;
+
+  const string indexname = trim_filename(dir + "/" + PKG_REPO_INDEX);
+
+  regex_t preg;
+  if (regcomp(&preg, pattern.c_str(), REG_EXTENDED | REG_NOSUB))
+  {
+    throw runtime_error("error compiling regular expression '" +
+        pattern + "', aborting");
+  }
+
+  /*
+   * Read the persisted index.  It has the same layout as the package
+   * database, with the identity of the package file instead of the
+   * version.
+   */
+  index_t old_index;
+  {
+    ifstream in(indexname.c_str());
+
+    while (in)
+    {
+      string  filename;
+      entry_t entry;
+
+      getline(in, filename);
+      getline(in, entry.identity);
+
+      for (;;)
+      {
+        string file;
+        getline(in, file);
+
+        if (file.empty())
+          break; /* End of record. */
+
+        entry.files.insert(entry.files.end(), file);
+      }
+      if (!filename.empty())
+        old_index[filename] = entry;
+    }
+  }
+
+  /*
+   * Look at the package files in the directory, taking over the
+   * records of those that did not change.
+   */
+  DIR* dp = opendir(dir.c_str());
+  if (!dp)
+    throw runtime_error_with_errno("could not read directory " + dir);
+
+  index_t        index;
+  vector<string> stale;
+  struct dirent* de;
+
+  while ((de = readdir(dp)))
+  {
+    const string filename = de->d_name;
+    const string path     = trim_filename(dir + "/" + filename);
+    struct stat  st;
+
+    if (   filename.find(PKG_EXT) == string::npos
+        || stat(path.c_str(), &st) == -1
+        || !S_ISREG(st.st_mode))
+      continue;
+
+    const string identity =
+      to_string(st.st_dev)  + " " + to_string(st.st_ino)  + " " +
+      to_string(st.st_size) + " " + to_string(st.st_mtim.tv_sec) + "." +
+      to_string(st.st_mtim.tv_nsec);
+
+    index_t::iterator i = old_index.find(filename);
+
+    if (i != old_index.end() && i->second.identity == identity)
+      index[filename] = i->second;
+    else
+    {
+      index[filename].identity = identity;
+      stale.push_back(filename);
+    }
+  }
+
+  closedir(dp);
+
+  /*
+   * List new or changed package files in parallel.
+   */
+  parallel_for(stale.size(), [&](size_t begin, size_t end)
+  {
+    for (size_t i = begin; i < end; ++i)
+    {
+      entry_t& entry = index.find(stale[i])->second;
+
+      /* nothing may escape to the thread pool */
+      try
+      {
+        entry.files =
+          pkg_open(trim_filename(dir + "/" + stale[i])).second.files;
+      }
+      catch (const exception& e)
+      {
+        entry.error = e.what();
+      }
+      catch (...)
+      {
+        entry.error = "unknown error";
+      }
+    }
+  });
+
+  for (size_t i = 0; i < stale.size(); ++i)
+  {
+    index_t::iterator entry = index.find(stale[i]);
+
+    if (!entry->second.error.empty())
+    {
+      cerr << utilname << ": " << stale[i] << ": "
+           << entry->second.error << endl;
+      index.erase(entry);
+    }
+  }
+
+  /*
+   * Persist the index if anything changed.  Not being allowed to is
+   * not an error, the next run just has to list the files again.
+   */
+  if (!stale.empty() || index.size() != old_index.size())
+  {
+    const string indexname_new = indexname + ".new";
+    ofstream     out(indexname_new.c_str());
+
+    for (index_t::const_iterator
+          i = index.begin(); i != index.end() && out; ++i)
+    {
+      out << i->first << '\n' << i->second.identity << '\n';
+      copy(i->second.files.begin(), i->second.files.end(),
+           ostream_iterator<string>(out, "\n"));
+      out << '\n';
+    }
+
+    out.close();
+
+    if (!out || rename(indexname_new.c_str(), indexname.c_str()) == -1)
+      unlink(indexname_new.c_str());
+  }
+
+  /*
+   * Look up the pattern.
+   */
+  vector<pair<string, string> > result;
+  result.push_back(pair<string, string>("Package", "File"));
+
+  unsigned int width = result.begin()->first.length();
+
+  for (index_t::const_iterator
+        i = index.begin(); i != index.end(); ++i)
+  {
+    for (set<string>::const_iterator
+          j = i->second.files.begin(); j != i->second.files.end(); ++j)
+    {
+      const string file('/' + *j);
+      if (!regexec(&preg, file.c_str(), 0, 0, 0))
+      {
+        result.push_back(pair<string, string>(i->first, *j));
+        if (i->first.length() > width)
+          width = i->first.length();
+      }
+    }
+  }
+
+  regfree(&preg);
+
+  if (result.size() > 1)
+  {
+    for (vector<pair<string, string>>::const_iterator
+          i = result.begin(); i != result.end(); ++i)
+    {
+      cout << left << setw(width + 2) << i->first << i->second << endl;
+    }
+  }
+  else
+  {
+    cout << utilname << ": no provider(s) found" << endl;
+  }
+}
+
 // vim: sw=2 ts=2 sts=2 et cc=72 tw=70
 // End of file.
@@ -15,6 +15,17 @@ public:
 
   virtual void run(int argc, char** argv) override;
   virtual void print_help() const override;
+
+private:
+  void print_sizes(const string& name);
+
+  void print_unowned();
+
+  void track();
+
+  void print_changes();
+
+  void print_providers(const string& pattern, const string& dir) const;
 }; // class pkginfo
 
 // vim: sw=2 ts=2 sts=2 et cc=72 tw=70
@@ -5,19 +5,28 @@
 #include <unistd.h>
 
 #include "pkgrm.h"
+#include "txlog.h"
 
 void
 pkgrm::print_help()
   const
 {
-  cout << R"(Usage: pkgrm [-Vhv] [-r rootdir] pkgname
+  cout << R"(Usage: pkgrm [-Vhv] [-j jobs] [-r rootdir] pkgname
+       pkgrm [-v] [-j jobs] [-r rootdir] -c layout
+       pkgrm [-v] [-j jobs] [-r rootdir] -R
 Remove software package.
 
 Mandatory arguments to long options are mandatory for short options too.
-  -r, --root=rootdir  specify an alternate root directory
-  -v, --verbose       explain what is being done
-  -V, --version       print version and exit
-  -h, --help          print help and exit
+  -c, --convert-db=layout  convert the package database to layout
+                           'single' (one file), 'sharded' (one file
+                           per package) or 'sqlite'
+  -j, --jobs=jobs          use jobs threads, 0 for the available CPUs
+  -r, --root=rootdir       specify an alternate root directory
+  -R, --repair             check the package database and repair it
+  -v, --verbose            explain what is being done, twice to also
+                           print file operation latencies
+  -V, --version            print version and exit
+  -h, --help               print help and exit
 )";
 }
 
@@ -28,22 +37,38 @@ pkgrm::run(int argc, char** argv)
    * Check command line options.
    */
   static int o_verbose = 0;
-  static string o_root, o_package;
+  static int o_repair  = 0;
+  static string o_root, o_package, o_layout;
   int opt;
   static struct option longopts[] = {
-    { "root",     required_argument,  NULL,  'r' },
-    { "verbose",  no_argument,        NULL,  'v' },
-    { "version",  no_argument,        NULL,  'V' },
-    { "help",     no_argument,        NULL,  'h' },
-    { 0,          0,                  0,     0   },
+    { "convert-db", required_argument,  NULL,  'c' },
+    { "jobs",       required_argument,  NULL,  'j' },
+    { "root",       required_argument,  NULL,  'r' },
+    { "repair",     no_argument,        NULL,  'R' },
+    { "verbose",    no_argument,        NULL,  'v' },
+    { "version",    no_argument,        NULL,  'V' },
+    { "help",       no_argument,        NULL,  'h' },
+    { 0,            0,                  0,     0   },
   };
 
-  while ((opt = getopt_long(argc, argv, "r:vVh", longopts, 0)) != -1)
+  while ((opt = getopt_long(argc, argv, "c:j:r:RvVh", longopts, 0)) != -1)
   {
     switch (opt) {
+    case 'c':
+      o_layout = optarg;
+      if (   o_layout != "single" && o_layout != "sharded"
+          && o_layout != "sqlite")
+        throw invalid_argument("invalid database layout: " + o_layout);
+      break;
+    case 'j':
+      set_jobs(optarg);
+      break;
     case 'r':
       o_root = optarg;
       break;
+    case 'R':
+      o_repair = 1;
+      break;
     case 'v':
       o_verbose++;
       break;
@@ -58,24 +83,74 @@ pkgrm::run(int argc, char** argv)
     }
   }
 
-  if (optind == argc)
+  if (!o_layout.empty() && o_repair)
+    throw invalid_argument("too many options");
+
+  if (!o_layout.empty() || o_repair)
+  {
+    if (optind != argc)
+      throw invalid_argument("too many arguments");
+  }
+  else if (optind == argc)
     throw invalid_argument("missing package name");
   else if (argc - optind > 1)
     throw invalid_argument("too many arguments");
 
-  o_package = argv[optind];
-
   /*
    * Check UID.
    */
   if (getuid())
-    throw runtime_error("only root can remove packages");
+    throw runtime_error(o_layout.empty() && !o_repair
+        ? "only root can remove packages"
+        : "only root can change the package database");
+
+  /* every database opened below is changed */
+  db_exclusive = true;
+
+  if (o_repair)
+  {
+    /*
+     * Check and repair database.
+     */
+    db_lock lock(o_root, true);
+
+    size_t problems = db_check(o_root, false, true);
+    if (o_verbose)
+      cout << problems << " problem(s) found" << endl;
+    return;
+  }
+
+  if (!o_layout.empty())
+  {
+    /*
+     * Convert database.
+     */
+    db_lock lock(o_root, true);
+    db_open(o_root);
+
+    if (o_verbose)
+      cout << "converting package database to " << o_layout
+           << " layout" << endl;
+
+    db_convert(o_layout);
+    return;
+  }
+
+  o_package = argv[optind];
+
+  if (o_verbose > 1)
+    latency_enable();
 
   /*
    * Remove package.
    */
+  tx_begin("remove", o_root);
+  tx->package = o_package;
+
+  try
   {
     db_lock lock(o_root, true);
+    tx_phase("open");
     db_open(o_root);
 
     if (!db_find_pkg(o_package))
@@ -84,9 +159,26 @@ pkgrm::run(int argc, char** argv)
     if (o_verbose)
       cout << "removing " << o_package << endl;
 
+    tx->old_version = packages[o_package].version;
+
+    tx_phase("remove");
     db_rm_pkg(o_package);
+    tx_phase("ldconfig");
     ldconfig();
+    tx_phase("commit");
     db_commit();
+    latency_report();
+    tx_end("ok");
+  }
+  catch (const db_locked_error& e)
+  {
+    tx_end("locked", e.what());
+    throw;
+  }
+  catch (const exception& e)
+  {
+    tx_end("error", e.what());
+    throw;
   }
 }
 
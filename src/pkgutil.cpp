@@ -7,6 +7,7 @@
 #include <iterator>
 #include <algorithm>
 #include <vector>
+#include <climits>
 #include <cstdio>
 #include <cstring>
 #include <cerrno>
@@ -17,8 +18,11 @@
 #include <grp.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/wait.h>
 #include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
 #include <sys/param.h>
 #include <sys/sysmacros.h>
 #include <unistd.h>
@@ -29,6 +33,13 @@
 #include <archive_entry.h>
 
 #include "pkgutil.h"
+#include "db.h"
+#include "latency.h"
+#include "probes.h"
+#include "tarlist.h"
+#include "threadpool.h"
+#include "txlog.h"
+#include "zstdbuf.h"
 
 #define INIT_ARCHIVE(ar)                    \
   archive_read_support_filter_gzip((ar));   \
@@ -40,11 +51,22 @@
 
 #define DEFAULT_BYTES_PER_BLOCK (20 * 512)
 
+/* items handed out to a thread at once by parallel_for() */
+#define PARALLEL_CHUNK 256
+
+/* environment variable overridden by --jobs */
+#define PKG_JOBS_ENV "PKGUTILS_JOBS"
+
 using __gnu_cxx::stdio_filebuf;
 
 pkgutil::pkgutil(const string& name)
-  : utilname(name)
+  : utilname(name), db_compressed(false), db_sharded(false),
+    db_exclusive(false), jobs(0)
 {
+  const char* env = getenv(PKG_JOBS_ENV);
+  if (env && *env)
+    set_jobs(env);
+
   /*
    * Ignore signals.
    */
@@ -57,13 +79,497 @@ pkgutil::pkgutil(const string& name)
   sigaction(SIGTERM, &sa, 0);
 }
 
+pkgutil::~pkgutil()
+{
+}
+
+/*
+ * Read a database record.
+ */
+static void
+db_read_record(istream& in, string& name, pkgutil::pkginfo_t& info)
+{
+  getline(in, name);
+  getline(in, info.version);
+
+  for (;;)
+  {
+    string file;
+    getline(in, file);
+
+    if (file.empty())
+      break; /* End of record. */
+
+    info.files.insert(info.files.end(), file);
+  }
+}
+
+/*
+ * Format a database record.
+ */
+static void
+db_format_record(string& out, const string& name,
+                 const pkgutil::pkginfo_t& info)
+{
+  out += name;
+  out += '\n';
+  out += info.version;
+  out += '\n';
+
+  for (set<string>::const_iterator
+        i = info.files.begin(); i != info.files.end(); ++i)
+  {
+    out += *i;
+    out += '\n';
+  }
+
+  out += '\n';
+}
+
+/*
+ * Write formatted records to a file, compressed if asked to, and
+ * synchronize it to disk.
+ */
+static bool
+db_write_records(int fd, const vector<string>& records, bool compressed)
+{
+#ifdef ENABLE_ZSTD_DB
+  if (compressed)
+  {
+    zstd_obuf zbuf(fd, PKG_DB_ZSTD_LEVEL);
+
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+      if (zbuf.sputn(records[i].data(), records[i].size()) !=
+            static_cast<streamsize>(records[i].size()))
+        return false;
+    }
+
+    if (zbuf.pubsync() == -1)
+      return false;
+
+    return fsync(fd) == 0;
+  }
+#else
+  (void)compressed;
+#endif
+
+  /*
+   * Hand as many records as possible to the kernel at once.
+   */
+  vector<struct iovec> iov;
+  iov.reserve(records.size());
+
+  for (size_t i = 0; i < records.size(); ++i)
+  {
+    struct iovec v;
+    v.iov_base = const_cast<char*>(records[i].data());
+    v.iov_len  = records[i].size();
+    iov.push_back(v);
+  }
+
+  for (size_t i = 0; i < iov.size(); )
+  {
+    ssize_t n = writev(fd, &iov[i],
+                       min(iov.size() - i, static_cast<size_t>(IOV_MAX)));
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+
+    /* a short write may end in the middle of a record */
+    for (; i < iov.size() && static_cast<size_t>(n) >= iov[i].iov_len; ++i)
+      n -= iov[i].iov_len;
+
+    if (n > 0)
+    {
+      iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + n;
+      iov[i].iov_len -= n;
+    }
+  }
+
+  return fsync(fd) == 0;
+}
+
+/*
+ * Check whether the database is split into one file per package.
+ */
+static bool
+db_is_sharded(const string& root)
+{
+  struct stat st;
+  return stat((root + PKG_DB_DIR).c_str(), &st) == 0
+      && S_ISDIR(st.st_mode);
+}
+
+/*
+ * Identify a version of the database file.
+ */
+static string
+db_stamp(const string& filename)
+{
+  struct stat st;
+
+  if (stat(filename.c_str(), &st) == -1)
+    return "";
+
+  return to_string(st.st_ino)  + " " + to_string(st.st_size) + " " +
+         to_string(st.st_mtim.tv_sec) + "." +
+         to_string(st.st_mtim.tv_nsec);
+}
+
+/*
+ * Remove a directory of package records, if it exists.
+ */
+static void
+db_remove_dir(const string& dirname)
+{
+  DIR* dir = opendir(dirname.c_str());
+  if (!dir)
+  {
+    if (errno == ENOENT)
+      return;
+    throw runtime_error_with_errno("could not read " + dirname);
+  }
+
+  while (struct dirent* entry = readdir(dir))
+  {
+    if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+      unlinkat(::dirfd(dir), entry->d_name, 0);
+  }
+  closedir(dir);
+
+  if (rmdir(dirname.c_str()) == -1)
+    throw runtime_error_with_errno("could not remove " + dirname);
+}
+
+/*
+ * Make renames in a directory durable.
+ */
+static void
+db_sync_dir(const string& dirname)
+{
+  int fd = open(dirname.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (fd == -1 || fsync(fd) == -1)
+  {
+    int e = errno;
+    if (fd != -1)
+      close(fd);
+    throw runtime_error_with_errno("could not synchronize " + dirname, e);
+  }
+
+  close(fd);
+}
+
+/*
+ * Journal of a commit to the directory of package records, see
+ * db_write_shards().  It lists one changed package per line, "+name"
+ * for a record written aside and "-name" for a removed one.
+ */
+#define SHARD_JOURNAL      ".journal"
+#define SHARD_JOURNAL_NEW  ".journal.incomplete_transaction"
+
+/*
+ * Name of the record of package NAME while it is written.
+ */
+static string
+db_shard_tmpname(const string& name)
+{
+  return "." + name + ".incomplete_transaction";
+}
+
+/*
+ * Read the journal of the directory of package records DIRFD into
+ * JOURNAL, true for a record written aside and false for a removed
+ * one.  Returns false if there is no journal.
+ */
+static bool
+db_read_journal(int dirfd, const string& dirname,
+                map<string, bool>& journal)
+{
+  int fd = openat(dirfd, SHARD_JOURNAL, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+  {
+    if (errno == ENOENT)
+      return false;
+    throw runtime_error_with_errno("could not open " + dirname +
+                                   "/" SHARD_JOURNAL);
+  }
+
+  string  text;
+  char    buf[64 * 1024];
+  ssize_t n;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    text.append(buf, n);
+
+  int e = errno;
+  close(fd);
+
+  if (n == -1)
+    throw runtime_error_with_errno("could not read " + dirname +
+                                   "/" SHARD_JOURNAL, e);
+
+  for (string::size_type pos = 0, end;
+        (end = text.find('\n', pos)) != string::npos; pos = end + 1)
+  {
+    if (end - pos > 1)
+      journal[text.substr(pos + 1, end - pos - 1)] = text[pos] == '+';
+  }
+
+  return true;
+}
+
+/*
+ * Complete the commit recorded in the journal of the directory of
+ * package records DIRFD, if there is one.  Only done with the
+ * database locked exclusively, readers see the journal instead.
+ */
+static void
+db_replay_shards(int dirfd, const string& dirname)
+{
+  map<string, bool> journal;
+
+  if (!db_read_journal(dirfd, dirname, journal))
+    return;
+
+  for (map<string, bool>::const_iterator i = journal.begin();
+       i != journal.end(); ++i)
+  {
+    const string& name = i->first;
+
+    /* a record that is gone was moved or removed before */
+    bool done = i->second
+      ? renameat(dirfd, db_shard_tmpname(name).c_str(),
+                 dirfd, name.c_str()) == 0
+      : unlinkat(dirfd, name.c_str(), 0) == 0;
+
+    if (!done && errno != ENOENT)
+      throw runtime_error_with_errno("could not complete the "
+          "transaction of " + dirname + "/" + name);
+  }
+
+  if (   fsync(dirfd) == -1
+      || (unlinkat(dirfd, SHARD_JOURNAL, 0) == -1 && errno != ENOENT))
+  {
+    throw runtime_error_with_errno("could not complete the "
+        "transaction of " + dirname);
+  }
+}
+
+/*
+ * Database in text files, one for all packages or one per package.
+ */
+class db_text : public db_backend
+{
+public:
+  explicit db_text(pkgutil& util) : util(util) {}
+
+  virtual void load(packages_t& packages) override
+  {
+    if (!util.db_sharded)
+      return util.db_read_file(packages);
+
+    /*
+     * Read all package records.
+     */
+    const string dirname = util.root + PKG_DB_DIR;
+
+    DIR* dir = opendir(dirname.c_str());
+    if (!dir)
+      throw runtime_error_with_errno("could not read " + dirname);
+
+    vector<string> names;
+    while (struct dirent* entry = readdir(dir))
+    {
+      /* skip ".", ".." and records being written */
+      if (entry->d_name[0] != '.')
+        names.push_back(entry->d_name);
+    }
+    closedir(dir);
+
+    /* records of a commit not completed yet are still aside */
+    for (map<string, bool>::const_iterator i = util.db_pending.begin();
+         i != util.db_pending.end(); ++i)
+    {
+      if (i->second)
+        names.push_back(i->first);
+    }
+
+    sort(names.begin(), names.end());
+    names.erase(unique(names.begin(), names.end()), names.end());
+    util.db_read_shards(names, packages);
+  }
+
+  virtual bool list(packages_t& packages) override
+  {
+    return util.db_read_names(packages);
+  }
+
+  virtual bool files_of(const string& name, packages_t& packages) override
+  {
+    /* with one file per package, a package is read alone */
+    if (!util.db_sharded)
+      return false;
+
+    util.db_read_shards(vector<string>(1, name), packages);
+    return true;
+  }
+
+  virtual bool owner_of(const string&, packages_t&) override
+  {
+    return false;
+  }
+
+  virtual void add(const string& name, const pkginfo_t&) override
+  {
+    changed.insert(name);
+  }
+
+  virtual void remove(const string& name) override
+  {
+    changed.insert(name);
+  }
+
+  virtual void commit(const packages_t& packages) override
+  {
+    if (util.db_sharded)
+      util.db_write_shards(path(), changed, packages);
+    else
+      util.db_write_file(packages);
+
+    changed.clear();
+  }
+
+  virtual string path() const override
+  {
+    return util.root + (util.db_sharded ? PKG_DB_DIR : PKG_DB);
+  }
+
+private:
+  pkgutil&    util;
+  set<string> changed;
+}; // class db_text
+
+void
+pkgutil::db_select()
+{
+  /*
+   * Pick the backend of the database found.
+   */
+  db_sharded = false;
+
+  if (file_exists(root + PKG_DB_SQLITE))
+  {
+#ifdef ENABLE_SQLITE_DB
+    db.reset(new db_sqlite(root + PKG_DB_SQLITE));
+    return;
+#else
+    throw runtime_error(root + PKG_DB_SQLITE + " found, but " +
+                        utilname + " was compiled without SQLite support");
+#endif
+  }
+
+  db_sharded = db_is_sharded(root);
+  db.reset(new db_text(*this));
+  db_pending.clear();
+
+  /*
+   * Finish a commit that was interrupted after its commit point, or
+   * only read its journal without the database locked exclusively.
+   */
+  if (db_sharded)
+  {
+    const string dirname = root + PKG_DB_DIR;
+
+    int dirfd = open(dirname.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1)
+      throw runtime_error_with_errno("could not open " + dirname);
+
+    try
+    {
+      if (db_exclusive)
+        db_replay_shards(dirfd, dirname);
+      else
+        db_read_journal(dirfd, dirname, db_pending);
+    }
+    catch (...)
+    {
+      close(dirfd);
+      throw;
+    }
+
+    close(dirfd);
+  }
+}
+
 void
 pkgutil::db_open(const string& path)
 {
+  root = trim_filename(path + "/");
+
+  PKG_PROBE1(db__open__start, root.c_str());
+
+  db_select();
+  db->load(packages);
+
   /*
-   * Read database.
+   * Read identities of the installed package files.  They are only
+   * an optimization, so a missing file is fine.
+   */
+  ifstream identities((root + PKG_DB_IDENTITY).c_str());
+  string   name, identity;
+
+  while (identities >> name >> identity)
+  {
+    packages_t::iterator i = packages.find(name);
+    if (i != packages.end())
+      i->second.identity = identity;
+  }
+
+  PKG_PROBE2(db__open__done, root.c_str(), packages.size());
+
+#ifndef NDEBUG
+  cerr << packages.size() << " packages found in database" << endl;
+#endif
+}
+
+bool
+pkgutil::db_open_pkg(const string& path, const string& name)
+{
+  /*
+   * Read a single package, if the backend can do that.
+   */
+  root = trim_filename(path + "/");
+
+  if (name.empty() || name[0] == '.' || name.find('/') != string::npos)
+    return false;
+
+  db_select();
+  return db->files_of(name, packages);
+}
+
+bool
+pkgutil::db_open_owner(const string& path, const string& file)
+{
+  /*
+   * Read the owners of a file, if the backend can do that.
    */
   root = trim_filename(path + "/");
+
+  db_select();
+  return db->owner_of(file, packages);
+}
+
+void
+pkgutil::db_read_file(packages_t& packages)
+{
+  /*
+   * Read database.
+   */
   const string filename = root + PKG_DB;
 
   int fd = open(filename.c_str(), O_RDONLY);
@@ -75,6 +581,25 @@ pkgutil::db_open(const string& path)
   if (!in)
     throw runtime_error_with_errno("could not read " + filename);
 
+  /*
+   * A database compressed with zstd(1) is recognized by its magic
+   * number and decompressed while it is parsed.
+   */
+#ifdef ENABLE_ZSTD_DB
+  zstd_ibuf zbuf(fd);
+
+  db_compressed = zstd_magic(fd);
+  if (db_compressed)
+    in.rdbuf(&zbuf);
+#else
+  char magic[4];
+
+  if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+      memcmp(magic, "\x28\xb5\x2f\xfd", sizeof(magic)) == 0)
+    throw runtime_error(filename + " is compressed, but " + utilname +
+                        " was compiled without zstd support");
+#endif
+
   while (!in.eof())
   {
     /*
@@ -83,30 +608,247 @@ pkgutil::db_open(const string& path)
     string    name;
     pkginfo_t info;
 
-    getline(in, name);
-    getline(in, info.version);
+    db_read_record(in, name, info);
+    if (!info.files.empty())
+      packages[name] = info;
+  }
+
+#ifdef ENABLE_ZSTD_DB
+  if (db_compressed && zbuf.failed())
+    throw runtime_error("could not decompress " + filename);
+#endif
+}
 
-    for (;;)
+void
+pkgutil::db_read_shards(const vector<string>& names,
+                        packages_t& packages)
+{
+  const string dirname = root + PKG_DB_DIR + "/";
+
+  vector<pair<string, pkginfo_t>> records(names.size());
+  vector<int>                     errors(names.size(), 0);
+
+  /*
+   * Records are independent files, read them in parallel.
+   */
+  parallel_for(names.size(), [&](size_t begin, size_t end)
+  {
+    for (size_t i = begin; i < end; ++i)
     {
-      string file;
-      getline(in, file);
+      map<string, bool>::const_iterator pending =
+        db_pending.find(names[i]);
+
+      if (pending != db_pending.end() && !pending->second)
+      {
+        errors[i] = ENOENT;
+        continue;
+      }
 
-      if (file.empty())
-        break; /* End of record. */
+      /* a record written aside may be moved into place meanwhile */
+      ifstream in;
+      if (pending != db_pending.end())
+        in.open((dirname + db_shard_tmpname(names[i])).c_str());
+      if (!in.is_open())
+        in.open((dirname + names[i]).c_str());
 
-      info.files.insert(info.files.end(), file);
+      if (!in)
+        errors[i] = errno;
+      else
+        db_read_record(in, records[i].first, records[i].second);
+
+      if (in.bad())
+        errors[i] = EIO;
     }
-    if (!info.files.empty())
-      packages[name] = info;
+  });
+
+  for (size_t i = 0; i < names.size(); ++i)
+  {
+    /* a package that is not installed has no record */
+    if (errors[i] == ENOENT)
+      continue;
+
+    if (errors[i])
+      throw runtime_error_with_errno("could not read " + dirname +
+                                     names[i], errors[i]);
+
+    if (!records[i].second.files.empty())
+      packages[records[i].first] = move(records[i].second);
   }
+}
 
-#ifndef NDEBUG
-  cerr << packages.size() << " packages found in database" << endl;
-#endif
+bool
+pkgutil::db_open_names(const string& path)
+{
+  root = trim_filename(path + "/");
+
+  db_select();
+  return db->list(packages);
+}
+
+bool
+pkgutil::db_read_names(packages_t& packages)
+{
+  /*
+   * Read only names and versions of the installed packages from the
+   * small index written along with the database, if it is up to date.
+   */
+  ifstream in((root + PKG_DB_NAMES).c_str());
+  string   stamp;
+
+  if (!getline(in, stamp) || stamp != db_stamp(db->path()))
+    return false;
+
+  string name, version;
+  while (in >> name >> version)
+    packages[name].version = version;
+
+  return !in.bad();
 }
 
 void
 pkgutil::db_commit()
+{
+  const size_t changed = db_changed.size();
+
+  PKG_PROBE2(db__commit__start, root.c_str(), changed);
+
+  for (set<string>::const_iterator
+        i = db_changed.begin(); i != db_changed.end(); ++i)
+  {
+    packages_t::const_iterator pkg = packages.find(*i);
+
+    if (pkg != packages.end() && !pkg->second.files.empty())
+      db->add(pkg->first, pkg->second);
+    else
+      db->remove(*i);
+  }
+
+  db->commit(packages);
+
+  db_changed.clear();
+  db_write_indexes();
+
+  PKG_PROBE2(db__commit__done, root.c_str(), changed);
+}
+
+void
+pkgutil::db_convert(const string& layout)
+{
+  const string dirname  = root + PKG_DB_DIR;
+  const string filename = root + PKG_DB;
+  const string sqlite   = root + PKG_DB_SQLITE;
+  const bool   text     = !file_exists(sqlite);
+
+  if (text && layout == (db_sharded ? "sharded" : "single"))
+    return;
+
+  if (!text && layout == "sqlite")
+    return;
+
+  /*
+   * Write the database in the new layout and move it into place.
+   * The SQLite file takes precedence over the text files, and the
+   * directory over the single file, so the old database is used
+   * until the new one is complete.
+   */
+  if (layout == "sqlite")
+  {
+#ifdef ENABLE_SQLITE_DB
+    const string sqlite_new = sqlite + ".incomplete_transaction";
+
+    if (unlink(sqlite_new.c_str()) == -1 && errno != ENOENT)
+      throw runtime_error_with_errno("could not remove " + sqlite_new);
+    unlink((sqlite_new + "-journal").c_str());
+
+    {
+      db_sqlite store(sqlite_new, true);
+
+      for (packages_t::const_iterator
+            i = packages.begin(); i != packages.end(); ++i)
+      {
+        if (!i->second.files.empty())
+          store.add(i->first, i->second);
+      }
+
+      store.commit(packages);
+    }
+
+    if (rename(sqlite_new.c_str(), sqlite.c_str()) == -1)
+      throw runtime_error_with_errno("could not rename " +
+                                      sqlite_new + " to " + sqlite);
+#else
+    throw runtime_error(utilname +
+                        " was compiled without SQLite support");
+#endif
+  }
+  else if (layout == "sharded")
+  {
+    const string dirname_new = dirname + ".incomplete_transaction";
+
+    db_remove_dir(dirname_new);
+
+    if (mkdir(dirname_new.c_str(), 0755) == -1)
+      throw runtime_error_with_errno("could not create " + dirname_new);
+
+    set<string> names;
+    for (packages_t::const_iterator
+          i = packages.begin(); i != packages.end(); ++i)
+    {
+      names.insert(names.end(), i->first);
+    }
+
+    db_write_shards(dirname_new, names, packages);
+
+    if (rename(dirname_new.c_str(), dirname.c_str()) == -1)
+      throw runtime_error_with_errno("could not rename " +
+                                  dirname_new + " to " + dirname);
+  }
+  else
+  {
+    db_compressed = false;
+    db_write_file(packages);
+  }
+
+  db_sync_dir(root + PKG_DIR);
+
+  /*
+   * Remove the old database, the single file is kept as backup.
+   */
+  db.reset();
+
+  if (!text)
+  {
+    if (unlink(sqlite.c_str()) == -1)
+      throw runtime_error_with_errno("could not remove " + sqlite);
+    unlink((sqlite + "-journal").c_str());
+  }
+  else if (db_sharded)
+  {
+    const string dirname_old = dirname + ".backup";
+
+    db_remove_dir(dirname_old);
+
+    if (rename(dirname.c_str(), dirname_old.c_str()) == -1)
+      throw runtime_error_with_errno("could not rename " +
+                                  dirname + " to " + dirname_old);
+
+    db_remove_dir(dirname_old);
+  }
+  else if (rename(filename.c_str(), (filename + ".backup").c_str()) == -1)
+  {
+    throw runtime_error_with_errno("could not rename " + filename +
+                                    " to " + filename + ".backup");
+  }
+
+  db_sync_dir(root + PKG_DIR);
+
+  db_select();
+  db_changed.clear();
+  db_write_indexes();
+}
+
+void
+pkgutil::db_write_file(const packages_t& packages)
 {
   const string dbfilename     = root + PKG_DB;
   const string dbfilename_new = dbfilename + ".incomplete_transaction";
@@ -120,61 +862,222 @@ pkgutil::db_commit()
                                     dbfilename_new);
 
   /*
-   * Write new database.
+   * Format the records, in parallel, one buffer per package.
+   */
+  vector<packages_t::const_iterator> pkgs;
+  pkgs.reserve(packages.size());
+
+  for (packages_t::const_iterator
+        i = packages.begin(); i != packages.end(); ++i)
+  {
+    if (!i->second.files.empty())
+      pkgs.push_back(i);
+  }
+
+  vector<string> records(pkgs.size());
+
+  parallel_for(pkgs.size(), [&](size_t begin, size_t end)
+  {
+    for (size_t i = begin; i < end; ++i)
+      db_format_record(records[i], pkgs[i]->first, pkgs[i]->second);
+  });
+
+  /*
+   * Write new database.  It is written to an unnamed file that is
+   * linked in once complete, so that a crash doesn't leave a partial
+   * transaction behind.  Where the filesystem doesn't support that,
+   * it is written to the named file directly.
+   */
+  int  fd_new = open((root + PKG_DIR).c_str(),
+                     O_TMPFILE | O_WRONLY | O_CLOEXEC, 0444);
+  bool linked = false;
+
+  if (fd_new != -1)
+  {
+    if (!db_write_records(fd_new, records, db_compressed))
+    {
+      int e = errno;
+      close(fd_new);
+      throw runtime_error_with_errno("could not write " +
+                                      dbfilename_new, e);
+    }
+
+    /* linking by descriptor needs CAP_DAC_READ_SEARCH, linking the
+     * /proc entry needs procfs */
+    const string procname = "/proc/self/fd/" + to_string(fd_new);
+
+    linked =
+         linkat(fd_new, "", AT_FDCWD, dbfilename_new.c_str(),
+                AT_EMPTY_PATH) == 0
+      || linkat(AT_FDCWD, procname.c_str(), AT_FDCWD,
+                dbfilename_new.c_str(), AT_SYMLINK_FOLLOW) == 0;
+
+    close(fd_new);
+  }
+
+  if (!linked)
+  {
+    fd_new = open(dbfilename_new.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0444);
+    if (fd_new == -1)
+      throw runtime_error_with_errno("could not create " +
+                                      dbfilename_new);
+
+    if (!db_write_records(fd_new, records, db_compressed))
+    {
+      int e = errno;
+      close(fd_new);
+      throw runtime_error_with_errno("could not write " +
+                                      dbfilename_new, e);
+    }
+
+    close(fd_new);
+  }
+
+  /*
+   * Relink database backup.  There is nothing to back up when
+   * converting from one file per package.
+   */
+  if (unlink(dbfilename_bak.c_str()) == -1 && errno != ENOENT)
+    throw runtime_error_with_errno("could not remove " +
+                                    dbfilename_bak);
+
+  if (link(dbfilename.c_str(), dbfilename_bak.c_str()) == -1 &&
+      errno != ENOENT)
+    throw runtime_error_with_errno("could not create " +
+                                    dbfilename_bak);
+
+  /*
+   * Move new database into place.
+   */
+  if (rename(dbfilename_new.c_str(), dbfilename.c_str()) == -1)
+    throw runtime_error_with_errno("could not rename " +
+                                dbfilename_new + " to " + dbfilename);
+}
+
+void
+pkgutil::db_write_shards(const string& dirname,
+                         const set<string>& names,
+                         const packages_t& packages)
+{
+  int dirfd = open(dirname.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd == -1)
+    throw runtime_error_with_errno("could not open " + dirname);
+
+  vector<string> changed(names.begin(), names.end());
+  vector<int>    errors(changed.size(), 0);
+
+  /*
+   * Write the records aside, in parallel.
+   */
+  parallel_for(changed.size(), [&](size_t begin, size_t end)
+  {
+    for (size_t i = begin; i < end; ++i)
+    {
+      packages_t::const_iterator pkg = packages.find(changed[i]);
+
+      if (pkg == packages.end() || pkg->second.files.empty())
+        continue;
+
+      vector<string> record(1);
+      db_format_record(record[0], pkg->first, pkg->second);
+
+      int fd = openat(dirfd, db_shard_tmpname(changed[i]).c_str(),
+          O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0444);
+
+      if (fd == -1 || !db_write_records(fd, record, false))
+        errors[i] = errno;
+
+      if (fd != -1)
+        close(fd);
+    }
+  });
+
+  /*
+   * Record the changes in a journal that is moved into place at
+   * once.  That is the commit point: the records are then moved into
+   * place or removed one by one, and if that is interrupted, the
+   * next db_select() completes it from the journal.
+   */
+  vector<string> journal(1);
+
+  for (size_t i = 0; i < changed.size(); ++i)
+  {
+    if (errors[i])
+    {
+      close(dirfd);
+      throw runtime_error_with_errno("could not write " + dirname +
+                                     "/" + changed[i], errors[i]);
+    }
+
+    packages_t::const_iterator pkg = packages.find(changed[i]);
+
+    journal[0] += (pkg != packages.end() && !pkg->second.files.empty())
+                ? '+' : '-';
+    journal[0] += changed[i] + '\n';
+  }
+
+  int fd = openat(dirfd, SHARD_JOURNAL_NEW,
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0444);
+
+  if (   fd == -1
+      || !db_write_records(fd, journal, false)
+      || renameat(dirfd, SHARD_JOURNAL_NEW, dirfd, SHARD_JOURNAL) == -1
+      || fsync(dirfd) == -1)
+  {
+    int e = errno;
+    if (fd != -1)
+      close(fd);
+    close(dirfd);
+    throw runtime_error_with_errno("could not commit to " + dirname, e);
+  }
+
+  close(fd);
+
+  try
+  {
+    db_replay_shards(dirfd, dirname);
+  }
+  catch (...)
+  {
+    close(dirfd);
+    throw;
+  }
+
+  close(dirfd);
+}
+
+void
+pkgutil::db_write_indexes()
+{
+  /*
+   * Write identities of the installed package files.
    */
-  int fd_new = creat(dbfilename_new.c_str(), 0444);
-  if (fd_new == -1)
-    throw runtime_error_with_errno("could not create " +
-                                    dbfilename_new);
-
-  stdio_filebuf<char> filebuf_new(fd_new, ios::out, getpagesize());
-  ostream db_new(&filebuf_new);
+  string identities;
 
   for (packages_t::const_iterator
         i = packages.begin(); i != packages.end(); ++i)
   {
-    if (!i->second.files.empty())
-    {
-      db_new << i->first << "\n";
-      db_new << i->second.version << "\n";
-      copy(i->second.files.begin(), i->second.files.end(),
-           ostream_iterator<string>(db_new, "\n"));
-      db_new << "\n";
-    }
+    if (!i->second.files.empty() && !i->second.identity.empty())
+      identities += i->first + " " + i->second.identity + "\n";
   }
 
-  db_new.flush();
-
-  /*
-   * Make sure the new database was successfully written.
-   */
-  if (!db_new)
-    throw runtime_error("could not write " + dbfilename_new);
-
-  /*
-   * Synchronize file to disk.
-   */
-  if (fsync(fd_new) == -1)
-    throw runtime_error_with_errno("could not synchronize " +
-                                    dbfilename_new);
+  file_replace(root + PKG_DB_IDENTITY, identities);
 
   /*
-   * Relink database backup.
+   * Write names and versions, stamped with the database they belong
+   * to.
    */
-  if (unlink(dbfilename_bak.c_str()) == -1 && errno != ENOENT)
-    throw runtime_error_with_errno("could not remove " +
-                                    dbfilename_bak);
+  string names = db_stamp(db->path()) + "\n";
 
-  if (link(dbfilename.c_str(), dbfilename_bak.c_str()) == -1)
-    throw runtime_error_with_errno("could not create " +
-                                    dbfilename_bak);
+  for (packages_t::const_iterator
+        i = packages.begin(); i != packages.end(); ++i)
+  {
+    if (!i->second.files.empty())
+      names += i->first + " " + i->second.version + "\n";
+  }
 
-  /*
-   * Move new database into place.
-   */
-  if (rename(dbfilename_new.c_str(), dbfilename.c_str()) == -1)
-    throw runtime_error_with_errno("could not rename " +
-                                dbfilename_new + " to " + dbfilename);
+  file_replace(root + PKG_DB_NAMES, names);
 
 #ifndef NDEBUG
   cerr << packages.size() << " packages written to database" << endl;
@@ -185,6 +1088,7 @@ void
 pkgutil::db_add_pkg(const string& name, const pkginfo_t& info)
 {
   packages[name] = info;
+  db_changed.insert(name);
 }
 
 bool
@@ -198,6 +1102,7 @@ pkgutil::db_rm_pkg(const string& name)
 {
   set<string> files = packages[name].files;
   packages.erase(name);
+  db_changed.insert(name);
 
 #ifndef NDEBUG
   cerr << "Removing package phase 1 (all files in package):" << endl;
@@ -235,7 +1140,20 @@ pkgutil::db_rm_pkg(const string& name)
         i = files.rbegin(); i != files.rend(); ++i)
   {
     const string filename = root + *i;
-    if (file_exists(filename) && remove(filename.c_str()) == -1)
+
+    if (!file_exists(filename))
+      continue;
+
+    latency_timer timer(latency ? &latency->unlink : 0, *i);
+    int r = remove(filename.c_str());
+    timer.stop();
+
+    PKG_PROBE2(remove__file, filename.c_str(), r == -1 ? errno : 0);
+
+    if (r == 0 && tx)
+      ++tx->removed;
+
+    if (r == -1)
     {
       const char* msg = strerror(errno);
       cerr << utilname << ": could not remove " << filename << ": "
@@ -249,6 +1167,7 @@ pkgutil::db_rm_pkg(const string& name, const set<string>& keep_list)
 {
   set<string> files = packages[name].files;
   packages.erase(name);
+  db_changed.insert(name);
 
 #ifndef NDEBUG
   cerr << "Removing package phase 1 (all files in package):" << endl;
@@ -304,7 +1223,20 @@ pkgutil::db_rm_pkg(const string& name, const set<string>& keep_list)
         i = files.rbegin(); i != files.rend(); ++i)
   {
     const string filename = root + *i;
-    if (file_exists(filename) && remove(filename.c_str()) == -1)
+
+    if (!file_exists(filename))
+      continue;
+
+    latency_timer timer(latency ? &latency->unlink : 0, *i);
+    int r = remove(filename.c_str());
+    timer.stop();
+
+    PKG_PROBE2(remove__file, filename.c_str(), r == -1 ? errno : 0);
+
+    if (r == 0 && tx)
+      ++tx->removed;
+
+    if (r == -1)
     {
       if (errno == ENOTEMPTY)
         continue;
@@ -322,150 +1254,594 @@ pkgutil::db_rm_files(set<string> files, const set<string>& keep_list)
   /*
    * Remove all references.
    */
-  for (packages_t::iterator
-        i = packages.begin(); i != packages.end(); ++i)
+  for (packages_t::iterator
+        i = packages.begin(); i != packages.end(); ++i)
+  {
+    for (set<string>::const_iterator
+          j = files.begin(); j != files.end(); ++j)
+    {
+      if (i->second.files.erase(*j))
+        db_changed.insert(i->first);
+    }
+  }
+
+#ifndef NDEBUG
+  cerr << "Removing files:" << endl;
+  copy(files.begin(), files.end(),
+       ostream_iterator<string>(cerr, "\n"));
+  cerr << endl;
+#endif
+
+  /*
+   * Don't delete files found in the keep list.
+   */
+  for (set<string>::const_iterator
+        i = keep_list.begin(); i != keep_list.end(); ++i)
+  {
+    files.erase(*i);
+  }
+
+  /*
+   * Delete the files.
+   */
+  for (set<string>::const_reverse_iterator
+        i = files.rbegin(); i != files.rend(); ++i)
+  {
+    const string filename = root + *i;
+
+    if (!file_exists(filename))
+      continue;
+
+    latency_timer timer(latency ? &latency->unlink : 0, *i);
+    int r = remove(filename.c_str());
+    timer.stop();
+
+    PKG_PROBE2(remove__file, filename.c_str(), r == -1 ? errno : 0);
+
+    if (r == 0 && tx)
+      ++tx->removed;
+
+    if (r == -1)
+    {
+      if (errno == ENOTEMPTY)
+        continue;
+
+      const char* msg = strerror(errno);
+      cerr << utilname << ": could not remove " << filename << ": "
+           << msg << endl;
+    }
+  }
+}
+
+set<string>
+pkgutil::db_find_conflicts(const string& name, const pkginfo_t&  info)
+{
+  set<string> files;
+
+  /*
+   * Find conflicting files in database.
+   */
+  PKG_PROBE1(conflicts__phase__start, 1);
+
+  for (packages_t::const_iterator
+        i = packages.begin(); i != packages.end(); ++i)
+  {
+    if (i->first != name)
+    {
+      set_intersection(info.files.begin(), info.files.end(),
+           i->second.files.begin(), i->second.files.end(),
+           inserter(files, files.end()));
+    }
+  }
+
+  PKG_PROBE2(conflicts__phase__done, 1, files.size());
+
+#ifndef NDEBUG
+  cerr << "Conflicts phase 1 (conflicts in database):" << endl;
+  copy(files.begin(), files.end(),
+       ostream_iterator<string>(cerr, "\n"));
+  cerr << endl;
+#endif
+
+  /*
+   * Find conflicting files in filesystem.
+   */
+  PKG_PROBE1(conflicts__phase__start, 2);
+
+  for (set<string>::iterator
+        i = info.files.begin(); i != info.files.end(); ++i)
+  {
+    const string filename = root + *i;
+
+    latency_timer timer(latency ? &latency->lstat : 0, *i);
+    bool exists = file_exists(filename);
+    timer.stop();
+
+    if (exists && files.find(*i) == files.end())
+      files.insert(files.end(), *i);
+  }
+
+  PKG_PROBE2(conflicts__phase__done, 2, files.size());
+
+#ifndef NDEBUG
+  cerr << "Conflicts phase 2 (conflicts in filesystem added):" << endl;
+  copy(files.begin(), files.end(),
+       ostream_iterator<string>(cerr, "\n"));
+  cerr << endl;
+#endif
+
+  /*
+   * Exclude directories.
+   */
+  PKG_PROBE1(conflicts__phase__start, 3);
+
+  set<string> tmp = files;
+  for (set<string>::const_iterator
+        i = tmp.begin(); i != tmp.end(); ++i)
+  {
+    if ((*i)[i->length() - 1] == '/')
+      files.erase(*i);
+  }
+
+  PKG_PROBE2(conflicts__phase__done, 3, files.size());
+
+#ifndef NDEBUG
+  cerr << "Conflicts phase 3 (directories excluded):" << endl;
+  copy(files.begin(), files.end(),
+       ostream_iterator<string>(cerr, "\n"));
+  cerr << endl;
+#endif
+
+  /*
+   * If this is an upgrade, remove files already owned by this
+   * package.
+   */
+  if (packages.find(name) != packages.end())
+  {
+    PKG_PROBE1(conflicts__phase__start, 4);
+
+    for (set<string>::const_iterator
+          i  = packages[name].files.begin();
+          i != packages[name].files.end();
+          ++i)
+    {
+      files.erase(*i);
+    }
+
+    PKG_PROBE2(conflicts__phase__done, 4, files.size());
+
+#ifndef NDEBUG
+    cerr << "Conflicts phase 4 "
+         << "(files already owned by this package excluded):"
+         << endl;
+    copy(files.begin(), files.end(),
+         ostream_iterator<string>(cerr, "\n"));
+    cerr << endl;
+#endif
+  }
+
+  return files;
+}
+
+/*
+ * Check whether a path can be recorded in the database.
+ */
+static bool
+db_valid_path(const string& file)
+{
+  const string path = "/" + file;
+
+  return file[0] != '/'
+      && path.find("//")   == string::npos
+      && path.find("/./")  == string::npos
+      && path.find("/../") == string::npos
+      && path.compare(path.length() - 2, 2, "/.")  != 0
+      && path.compare(path.length() - 3, 3, "/..") != 0;
+}
+
+/*
+ * A database record found by db_check().
+ */
+struct db_record_t
+{
+  const char* begin;
+  const char* end;
+  size_t      source;
+  size_t      line;
+  string      name;
+};
+
+/*
+ * A file owned by a record, see db_check().
+ */
+struct db_owned_t
+{
+  const char* path;
+  size_t      length;
+  size_t      record;
+
+  bool operator<(const db_owned_t& other) const
+  {
+    int cmp = memcmp(path, other.path, min(length, other.length));
+    return cmp ? cmp < 0 : length < other.length;
+  }
+
+  bool operator==(const db_owned_t& other) const
+  {
+    return length == other.length && !memcmp(path, other.path, length);
+  }
+};
+
+size_t
+pkgutil::db_check(const string& path, bool on_disk, bool repair)
+{
+  root = trim_filename(path + "/");
+
+  db_select();
+  if (file_exists(root + PKG_DB_SQLITE))
+    throw runtime_error("checking " + root + PKG_DB_SQLITE +
+                        " is not supported, see sqlite3(1)");
+
+  /*
+   * Read the database as it is, without interpreting it.
+   */
+  vector<string> sources;
+  vector<string> texts;
+
+  if (db_sharded)
+  {
+    const string dirname = root + PKG_DB_DIR;
+
+    DIR* dir = opendir(dirname.c_str());
+    if (!dir)
+      throw runtime_error_with_errno("could not read " + dirname);
+
+    while (struct dirent* entry = readdir(dir))
+    {
+      if (entry->d_name[0] != '.')
+        sources.push_back(entry->d_name);
+    }
+    closedir(dir);
+
+    sort(sources.begin(), sources.end());
+  }
+  else
+  {
+    sources.push_back("");
+  }
+
+  texts.resize(sources.size());
+
+  vector<int> errors(sources.size(), 0);
+
+  parallel_for(sources.size(), [&](size_t begin, size_t end)
+  {
+    for (size_t i = begin; i < end; ++i)
+    {
+      const string filename = db_sharded
+        ? root + PKG_DB_DIR + "/" + sources[i] : root + PKG_DB;
+
+      int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd == -1)
+      {
+        errors[i] = errno;
+        continue;
+      }
+
+      stdio_filebuf<char> filebuf(fd, ios::in, 64 * 1024);
+      istream             in(&filebuf);
+
+#ifdef ENABLE_ZSTD_DB
+      zstd_ibuf zbuf(fd);
+
+      if (zstd_magic(fd))
+        in.rdbuf(&zbuf);
+#endif
+
+      texts[i].assign(istreambuf_iterator<char>(in),
+                      istreambuf_iterator<char>());
+
+#ifdef ENABLE_ZSTD_DB
+      if (zbuf.failed())
+        errors[i] = EILSEQ;
+#endif
+    }
+  });
+
+  for (size_t i = 0; i < sources.size(); ++i)
+  {
+    if (errors[i])
+      throw runtime_error_with_errno("could not read " + root +
+          (db_sharded ? PKG_DB_DIR "/" + sources[i] : PKG_DB),
+          errors[i]);
+  }
+
+  /*
+   * Split into records, they are separated by an empty line.
+   */
+  vector<db_record_t> records;
+
+  for (size_t i = 0; i < texts.size(); ++i)
+  {
+    const char* p    = texts[i].data();
+    const char* end  = p + texts[i].size();
+    size_t      line = 1;
+
+    while (p < end)
+    {
+      db_record_t record;
+      record.begin  = p;
+      record.source = i;
+      record.line   = line;
+
+      while (p < end && *p != '\n')
+      {
+        const char* eol = static_cast<const char*>(
+            memchr(p, '\n', end - p));
+        p = eol ? eol + 1 : end;
+        ++line;
+      }
+
+      record.end = p;
+      records.push_back(record);
+
+      /* skip the empty line */
+      if (p < end)
+      {
+        ++p;
+        ++line;
+      }
+    }
+  }
+
+  /*
+   * Check the records, in parallel.
+   */
+  vector<vector<string>>     problems(records.size());
+  vector<vector<db_owned_t>> owned(records.size());
+
+  int rootfd = on_disk
+    ? open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+  if (on_disk && rootfd == -1)
+    throw runtime_error_with_errno("could not open " + root);
+
+  parallel_for(records.size(), [&](size_t begin, size_t end)
   {
-    for (set<string>::const_iterator
-          j = files.begin(); j != files.end(); ++j)
+    for (size_t i = begin; i < end; ++i)
     {
-      i->second.files.erase(*j);
+      db_record_t&    record = records[i];
+      vector<string>& found  = problems[i];
+      const string    where  =
+        (db_sharded ? PKG_DB_DIR "/" + sources[record.source] : PKG_DB)
+        + ":";
+
+      vector<pair<const char*, size_t>> lines;
+      for (const char* p = record.begin; p < record.end; )
+      {
+        const char* eol = static_cast<const char*>(
+            memchr(p, '\n', record.end - p));
+        if (!eol)
+          eol = record.end;
+        lines.push_back(make_pair(p, static_cast<size_t>(eol - p)));
+        p = eol + 1;
+      }
+
+      const string at = where + to_string(record.line) + ": ";
+
+      if (lines.empty())
+      {
+        found.push_back(at + "empty record");
+        continue;
+      }
+
+      record.name.assign(lines[0].first, lines[0].second);
+
+      if (   record.name.empty()
+          || record.name.find_first_of(" \t/") != string::npos
+          || record.name[0] == '.')
+        found.push_back(at + "invalid package name '" +
+                        record.name + "'");
+
+      if (db_sharded && record.name != sources[record.source])
+        found.push_back(at + "record of '" + record.name +
+                        "' in the file of another package");
+
+      if (lines.size() < 2 || !lines[1].second)
+        found.push_back(at + "missing version");
+      else if (memchr(lines[1].first, ' ', lines[1].second))
+        found.push_back(at + "invalid version '" +
+                        string(lines[1].first, lines[1].second) + "'");
+
+      if (lines.size() < 3)
+        found.push_back(at + "no files");
+
+      for (size_t j = 2; j < lines.size(); ++j)
+      {
+        const string file(lines[j].first, lines[j].second);
+        const string fat = where + to_string(record.line + j) + ": ";
+
+        bool valid = db_valid_path(file);
+        if (!valid)
+          found.push_back(fat + "invalid path '" + file + "'");
+
+        if (j > 2)
+        {
+          int cmp = file.compare(0, string::npos,
+                                 lines[j - 1].first, lines[j - 1].second);
+          if (cmp == 0)
+            found.push_back(fat + "duplicate file '" + file + "'");
+          else if (cmp < 0)
+            found.push_back(fat + "file '" + file + "' out of order");
+        }
+
+        /* directories are shared between packages */
+        if (file[file.length() - 1] != '/')
+        {
+          db_owned_t entry = { lines[j].first, lines[j].second, i };
+          owned[i].push_back(entry);
+        }
+
+        struct stat st;
+        if (rootfd != -1 && valid &&
+            fstatat(rootfd, file.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+          found.push_back(fat + "'" + file + "' missing on disk");
+      }
     }
-  }
+  });
 
-#ifndef NDEBUG
-  cerr << "Removing files:" << endl;
-  copy(files.begin(), files.end(),
-       ostream_iterator<string>(cerr, "\n"));
-  cerr << endl;
-#endif
+  if (rootfd != -1)
+    close(rootfd);
 
   /*
-   * Don't delete files found in the keep list.
+   * Check packages recorded twice and files owned by more than one
+   * package.
    */
-  for (set<string>::const_iterator
-        i = keep_list.begin(); i != keep_list.end(); ++i)
+  map<string, size_t> names;
+
+  for (size_t i = 0; i < records.size(); ++i)
   {
-    files.erase(*i);
+    map<string, size_t>::iterator first = names.find(records[i].name);
+
+    if (first == names.end())
+      names[records[i].name] = i;
+    else
+      problems[i].push_back(
+          (db_sharded ? PKG_DB_DIR "/" + sources[records[i].source]
+                      : PKG_DB)
+          + ":" + to_string(records[i].line) + ": package '" +
+          records[i].name + "' recorded again");
   }
 
-  /*
-   * Delete the files.
-   */
-  for (set<string>::const_reverse_iterator
-        i = files.rbegin(); i != files.rend(); ++i)
+  vector<db_owned_t> files;
+  for (size_t i = 0; i < owned.size(); ++i)
+    files.insert(files.end(), owned[i].begin(), owned[i].end());
+
+  sort(files.begin(), files.end());
+
+  for (size_t i = 1; i < files.size(); ++i)
   {
-    const string filename = root + *i;
-    if (file_exists(filename) && remove(filename.c_str()) == -1)
+    if (files[i] == files[i - 1] &&
+        records[files[i].record].name !=
+          records[files[i - 1].record].name)
     {
-      if (errno == ENOTEMPTY)
-        continue;
-
-      const char* msg = strerror(errno);
-      cerr << utilname << ": could not remove " << filename << ": "
-           << msg << endl;
+      problems[files[i].record].push_back(
+          "'" + string(files[i].path, files[i].length) +
+          "' owned by " + records[files[i - 1].record].name + " and " +
+          records[files[i].record].name);
     }
   }
-}
-
-set<string>
-pkgutil::db_find_conflicts(const string& name, const pkginfo_t&  info)
-{
-  set<string> files;
 
   /*
-   * Find conflicting files in database.
+   * Look for leftovers of interrupted transactions.
    */
-  for (packages_t::const_iterator
-        i = packages.begin(); i != packages.end(); ++i)
+  vector<string> stale;
+
+  if (file_exists(root + PKG_DB ".incomplete_transaction"))
+    stale.push_back(PKG_DB ".incomplete_transaction");
+  if (file_exists(root + PKG_DB_DIR ".incomplete_transaction"))
+    stale.push_back(PKG_DB_DIR ".incomplete_transaction");
+  if (file_exists(root + PKG_DB_DIR ".backup"))
+    stale.push_back(PKG_DB_DIR ".backup");
+
+  if (db_sharded)
   {
-    if (i->first != name)
+    if (DIR* dir = opendir((root + PKG_DB_DIR).c_str()))
     {
-      set_intersection(info.files.begin(), info.files.end(),
-           i->second.files.begin(), i->second.files.end(),
-           inserter(files, files.end()));
+      while (struct dirent* entry = readdir(dir))
+      {
+        if (entry->d_name[0] == '.' && strcmp(entry->d_name, ".") &&
+            strcmp(entry->d_name, ".."))
+          stale.push_back(string(PKG_DB_DIR "/") + entry->d_name);
+      }
+      closedir(dir);
     }
   }
 
-#ifndef NDEBUG
-  cerr << "Conflicts phase 1 (conflicts in database):" << endl;
-  copy(files.begin(), files.end(),
-       ostream_iterator<string>(cerr, "\n"));
-  cerr << endl;
-#endif
-
   /*
-   * Find conflicting files in filesystem.
+   * Report.
    */
-  for (set<string>::iterator
-        i = info.files.begin(); i != info.files.end(); ++i)
-  {
-    const string filename = root + *i;
+  size_t count = stale.size();
 
-    if (file_exists(filename) && files.find(*i) == files.end())
-      files.insert(files.end(), *i);
+  for (size_t i = 0; i < problems.size(); ++i)
+  {
+    for (size_t j = 0; j < problems[i].size(); ++j)
+      cout << problems[i][j] << endl;
+    count += problems[i].size();
   }
 
-#ifndef NDEBUG
-  cerr << "Conflicts phase 2 (conflicts in filesystem added):" << endl;
-  copy(files.begin(), files.end(),
-       ostream_iterator<string>(cerr, "\n"));
-  cerr << endl;
-#endif
+  for (size_t i = 0; i < stale.size(); ++i)
+    cout << stale[i] << ": left over by an interrupted transaction"
+         << endl;
+
+  if (!repair || !count)
+    return count;
 
   /*
-   * Exclude directories.
+   * Repair.  Leftovers are removed, and the database is read and
+   * written again, which sorts the file lists and drops duplicates,
+   * invalid paths and records that are empty or can't be named (of a
+   * package recorded twice, the last record is kept).  Files owned by
+   * more than one package and files missing on disk are left alone.
    */
-  set<string> tmp = files;
-  for (set<string>::const_iterator
-        i = tmp.begin(); i != tmp.end(); ++i)
+  for (size_t i = 0; i < stale.size(); ++i)
   {
-    if ((*i)[i->length() - 1] == '/')
-      files.erase(*i);
+    const string filename = root + stale[i];
+
+    struct stat st;
+    if (lstat(filename.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+      db_remove_dir(filename);
+    else if (unlink(filename.c_str()) == -1 && errno != ENOENT)
+      throw runtime_error_with_errno("could not remove " + filename);
   }
 
-#ifndef NDEBUG
-  cerr << "Conflicts phase 3 (directories excluded):" << endl;
-  copy(files.begin(), files.end(),
-       ostream_iterator<string>(cerr, "\n"));
-  cerr << endl;
-#endif
+  packages.clear();
+  db_open(path);
 
-  /*
-   * If this is an upgrade, remove files already owned by this
-   * package.
-   */
-  if (packages.find(name) != packages.end())
+  for (packages_t::iterator i = packages.begin(); i != packages.end(); )
   {
-    for (set<string>::const_iterator
-          i  = packages[name].files.begin();
-          i != packages[name].files.end();
-          ++i)
+    if (   i->first.empty()
+        || i->first.find_first_of(" \t/") != string::npos
+        || i->first[0] == '.'
+        || i->second.version.empty()
+        || i->second.version.find(' ') != string::npos)
     {
-      files.erase(*i);
+      packages.erase(i++);
+      continue;
     }
 
-#ifndef NDEBUG
-    cerr << "Conflicts phase 4 "
-         << "(files already owned by this package excluded):"
-         << endl;
-    copy(files.begin(), files.end(),
-         ostream_iterator<string>(cerr, "\n"));
-    cerr << endl;
-#endif
+    set<string>& files = i->second.files;
+    for (set<string>::iterator j = files.begin(); j != files.end(); )
+    {
+      if (!db_valid_path(*j))
+        files.erase(j++);
+      else
+        ++j;
+    }
+
+    ++i;
   }
 
-  return files;
+  /* records of the packages dropped are removed as well */
+  if (db_sharded)
+  {
+    for (size_t i = 0; i < sources.size(); ++i)
+      db_changed.insert(sources[i]);
+  }
+  for (packages_t::const_iterator
+        i = packages.begin(); i != packages.end(); ++i)
+  {
+    db_changed.insert(i->first);
+  }
+
+  db_commit();
+
+  return count;
 }
 
-pair<string, pkgutil::pkginfo_t>
-pkgutil::pkg_open(const string& filename)
+pair<string, string>
+pkgutil::pkg_name(const string& filename)
   const
 {
-  pair<string, pkginfo_t> result;
-  unsigned int i;
-  struct archive* archive;
-  struct archive_entry* entry;
-
   /*
    * Extract name and version from filename.
    */
@@ -483,8 +1859,50 @@ pkgutil::pkg_open(const string& filename)
                          basename + ": Invalid package name");
   }
 
-  result.first = name;
-  result.second.version = version;
+  return pair<string, string>(name, version);
+}
+
+pair<string, pkgutil::pkginfo_t>
+pkgutil::pkg_open(const string& filename, manifest_t* manifest)
+  const
+{
+  pair<string, pkginfo_t> result;
+  unsigned int i;
+  struct archive* archive;
+  struct archive_entry* entry;
+
+  pair<string, string> name = pkg_name(filename);
+
+  result.first = name.first;
+  result.second.version = name.second;
+
+#ifdef ENABLE_NATIVE_TAR
+  /*
+   * Read the headers of the common formats without libarchive,
+   * which starts over if anything is unusual.
+   */
+  bool listed = tar_list(filename, [&](const tar_entry_t& entry)
+  {
+    result.second.files.insert(result.second.files.end(), entry.path);
+    if (!manifest)
+      return;
+
+    if (entry.hardlink)
+      manifest->hardlinks[entry.path] = entry.link;
+    else if (S_ISREG(entry.mode))
+    {
+      manifest->size += entry.size;
+      manifest->sizes[entry.path] = entry.size;
+    }
+  });
+
+  if (listed)
+    return result;
+
+  result.second.files.clear();
+  if (manifest)
+    *manifest = manifest_t();
+#endif
 
   archive = archive_read_new();
   INIT_ARCHIVE(archive);
@@ -507,6 +1925,20 @@ pkgutil::pkg_open(const string& filename)
 
     mode_t mode = archive_entry_mode(entry);
 
+    if (manifest)
+    {
+      const char* target = archive_entry_hardlink(entry);
+
+      if (target)
+        manifest->hardlinks[archive_entry_pathname(entry)] = target;
+      else if (S_ISREG(mode))
+      {
+        manifest->size += archive_entry_size(entry);
+        manifest->sizes[archive_entry_pathname(entry)] =
+          archive_entry_size(entry);
+      }
+    }
+
     if (   S_ISREG(mode)
         && archive_read_data_skip(archive) != ARCHIVE_OK)
     {
@@ -523,23 +1955,264 @@ pkgutil::pkg_open(const string& filename)
       throw runtime_error("could not read " + filename);
   }
 
-  archive_read_free(archive);
+  archive_read_free(archive);
+
+  return result;
+}
+
+/*
+ * Compare the data of the current archive entry with the already
+ * installed regular file FD.  If they differ, the entry is extracted
+ * via DISK, taking the already compared prefix from FD instead of
+ * decompressing it twice.
+ *
+ * Returns 1 if the contents are equal and nothing was written, 0 if
+ * the entry was extracted, and -1 on error.
+ */
+static int
+extract_if_changed(struct archive*        archive,
+                   struct archive*        disk,
+                   struct archive_entry*  entry,
+                   int                    fd)
+{
+  const void* block;
+  size_t      size;
+  la_int64_t  offset;
+  la_int64_t  position = 0;
+  char        buf[DEFAULT_BYTES_PER_BLOCK];
+  int         r;
+
+  while ((r = archive_read_data_block(archive, &block, &size, &offset))
+         == ARCHIVE_OK)
+  {
+    bool equal = (offset == position);
+
+    for (size_t done = 0; equal && done < size; )
+    {
+      size_t  n   = min(size - done, sizeof(buf));
+      ssize_t got = pread(fd, buf, n, position + done);
+
+      equal = (got == static_cast<ssize_t>(n))
+           && !memcmp(buf, static_cast<const char*>(block) + done, n);
+      done += n;
+    }
+
+    if (!equal)
+      break;
+
+    position += size;
+  }
+
+  if (r == ARCHIVE_EOF)
+    return (position == archive_entry_size(entry)) ? 1 : -1;
+  else if (r != ARCHIVE_OK)
+    return -1;
+
+  /*
+   * Contents differ, write the entry out for real: first the equal
+   * prefix we already have on disk, then the rest of the archive data.
+   * The old inode stays readable through FD after it is unlinked.
+   */
+  if (archive_write_header(disk, entry) != ARCHIVE_OK)
+  {
+    archive_copy_error(archive, disk);
+    return -1;
+  }
+
+  for (la_int64_t copied = 0; copied < position; )
+  {
+    ssize_t got = pread(fd, buf,
+        min(static_cast<la_int64_t>(sizeof(buf)), position - copied),
+        copied);
+
+    if (   got <= 0
+        || archive_write_data_block(disk, buf, got, copied) != ARCHIVE_OK)
+    {
+      archive_copy_error(archive, disk);
+      return -1;
+    }
+
+    copied += got;
+  }
+
+  do
+  {
+    if (archive_write_data_block(disk, block, size, offset) != ARCHIVE_OK)
+    {
+      archive_copy_error(archive, disk);
+      return -1;
+    }
+  }
+  while ((r = archive_read_data_block(archive, &block, &size, &offset))
+         == ARCHIVE_OK);
+
+  if (r != ARCHIVE_EOF)
+    return -1;
+
+  if (archive_write_finish_entry(disk) != ARCHIVE_OK)
+  {
+    archive_copy_error(archive, disk);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Bring owner, permissions and modification time of the installed
+ * file FD in line with the archive entry.  Returns 0 on success and
+ * -1 with errno set on the first failure.
+ */
+static int
+fixup_metadata(struct archive*        disk,
+               struct archive_entry*  entry,
+               int                    fd,
+               const struct stat&     st)
+{
+  uid_t  uid  = archive_write_disk_uid(disk,
+                  archive_entry_uname(entry), archive_entry_uid(entry));
+  gid_t  gid  = archive_write_disk_gid(disk,
+                  archive_entry_gname(entry), archive_entry_gid(entry));
+  mode_t mode = archive_entry_perm(entry);
+
+  /* chown() may clear set-user-ID and set-group-ID bits, so do it
+   * before chmod() */
+  bool owner = st.st_uid != uid || st.st_gid != gid;
+
+  if (owner && fchown(fd, uid, gid) == -1)
+    return -1;
+
+  if ((owner || (st.st_mode & 07777) != mode) && fchmod(fd, mode) == -1)
+    return -1;
+
+  if (archive_entry_mtime_is_set(entry)
+      && (   st.st_mtim.tv_sec  != archive_entry_mtime(entry)
+          || st.st_mtim.tv_nsec != archive_entry_mtime_nsec(entry)))
+  {
+    struct timespec times[2];
+
+    times[0].tv_nsec = UTIME_OMIT;
+    if (archive_entry_atime_is_set(entry))
+    {
+      times[0].tv_sec  = archive_entry_atime(entry);
+      times[0].tv_nsec = archive_entry_atime_nsec(entry);
+    }
+    times[1].tv_sec  = archive_entry_mtime(entry);
+    times[1].tv_nsec = archive_entry_mtime_nsec(entry);
+
+    if (futimens(fd, times) == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Whether ENTRY or the installed file FD carry ACLs or extended
+ * attributes that pkg_install() would have to set.  fixup_metadata()
+ * does not handle them, such files are extracted in full instead.
+ */
+static bool
+has_extended_metadata(struct archive_entry* entry, int fd)
+{
+#if defined(ENABLE_EXTRACT_ACL) || defined(ENABLE_EXTRACT_XATTR)
+  /* ACLs are stored as extended attributes as well */
+  if (flistxattr(fd, 0, 0) > 0)
+    return true;
+#else
+  (void) fd;
+#endif
+
+#ifdef ENABLE_EXTRACT_ACL
+  if (archive_entry_acl_count(entry,
+        ARCHIVE_ENTRY_ACL_TYPE_POSIX1E | ARCHIVE_ENTRY_ACL_TYPE_NFS4) > 0)
+  {
+    return true;
+  }
+#endif
+
+#ifdef ENABLE_EXTRACT_XATTR
+  if (archive_entry_xattr_count(entry) > 0)
+    return true;
+#endif
+
+  (void) entry;
+  return false;
+}
+
+/*
+ * Return a descriptor of directory DIR, opened only once per install.
+ */
+static int
+cached_dirfd(map<string, int>& dirfds, const string& dir)
+{
+  map<string, int>::iterator i = dirfds.find(dir);
+
+  if (i == dirfds.end())
+  {
+    int fd = open(dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    i = dirfds.insert(make_pair(dir, fd)).first;
+  }
+
+  return i->second;
+}
+
+/*
+ * Replace LINK by a hardlink to TARGET, both being absolute paths.
+ * Returns false if the link could not be created this way.
+ */
+static bool
+link_file(map<string, int>& dirfds,
+          const string&     target,
+          const string&     link)
+{
+  string::size_type tslash = target.rfind('/');
+  string::size_type lslash = link.rfind('/');
+
+  int tfd = cached_dirfd(dirfds, target.substr(0, tslash + 1));
+  int lfd = cached_dirfd(dirfds, link.substr(0, lslash + 1));
+
+  if (tfd == -1 || lfd == -1)
+    return false;
+
+  const char* tname = target.c_str() + tslash + 1;
+  const char* lname = link.c_str()   + lslash + 1;
+
+  /*
+   * Nothing to do if the link is already there.
+   */
+  struct stat tst, lst;
+  if (   fstatat(tfd, tname, &tst, AT_SYMLINK_NOFOLLOW) == 0
+      && fstatat(lfd, lname, &lst, AT_SYMLINK_NOFOLLOW) == 0
+      && tst.st_dev == lst.st_dev
+      && tst.st_ino == lst.st_ino)
+  {
+    return true;
+  }
+
+  if (unlinkat(lfd, lname, 0) == -1 && errno != ENOENT)
+    return false;
 
-  return result;
+  return linkat(tfd, tname, lfd, lname, 0) == 0;
 }
 
-void
+bool
 pkgutil::pkg_install(const string& filename,
+                     const manifest_t& manifest,
                      const set<string>& keep_list,
                      const set<string>& non_install_list,
                      bool upgrade)
   const
 {
   struct archive*        archive;
+  struct archive*        disk;
   struct archive_entry*  entry;
   unsigned int           i;
   char                   buf[PATH_MAX];
   string                 absroot;
+  map<string, int>       dirfds;
+  map<string, string>    link_targets;
+  bool                   complete = true;
 
   archive = archive_read_new();
   INIT_ARCHIVE(archive);
@@ -553,15 +2226,46 @@ pkgutil::pkg_install(const string& filename,
         archive_errno(archive));
   }
 
+  auto flags =
+      ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM
+    | ARCHIVE_EXTRACT_TIME  | ARCHIVE_EXTRACT_UNLINK
+#ifdef ENABLE_EXTRACT_ACL
+    | ARCHIVE_EXTRACT_ACL
+#endif
+#ifdef ENABLE_EXTRACT_XATTR
+    | ARCHIVE_EXTRACT_XATTR
+#endif
+    ;
+
+  disk = archive_write_disk_new();
+  archive_write_disk_set_options(disk, flags);
+  archive_write_disk_set_standard_lookup(disk);
+
   chdir(root.c_str());
   absroot = getcwd(buf, sizeof(buf));
 
+  /*
+   * Hardlink targets, mapped to their installed location once they
+   * are extracted.
+   */
+  for (map<string, string>::const_iterator
+        j = manifest.hardlinks.begin(); j != manifest.hardlinks.end(); ++j)
+  {
+    link_targets[j->second];
+  }
+
   for (i = 0;
         archive_read_next_header(archive, &entry) == ARCHIVE_OK;
         ++i)
   {
     string archive_filename = archive_entry_pathname(entry);
 
+    latency_timer timer(latency ? &latency->extract : 0,
+                        archive_filename);
+
+    PKG_PROBE2(extract__start, archive_filename.c_str(),
+               archive_entry_size(entry));
+
     string reject_dir =
       trim_filename(absroot + string("/") + string(PKG_REJECTED));
 
@@ -580,6 +2284,9 @@ pkgutil::pkg_install(const string& filename,
 
       cout << utilname << ": ignoring " << archive_filename << endl;
 
+      if (tx)
+        ++tx->ignored;
+
       mode = archive_entry_mode(entry);
 
       if (S_ISREG(mode))
@@ -601,26 +2308,96 @@ pkgutil::pkg_install(const string& filename,
     archive_entry_set_pathname(entry,
         const_cast<char*>(real_filename.c_str()));
 
+    /*
+     * Hardlink to an already installed file: link it directly,
+     * relative to the cached directory descriptors.  Rejected links
+     * go through libarchive and the check of rejected files below.
+     */
+    const char* hardlink = archive_entry_hardlink(entry);
+
+    if (hardlink && real_filename == original_filename)
+    {
+      map<string, string>::const_iterator
+        target = link_targets.find(hardlink);
+
+      if (   target != link_targets.end()
+          && !target->second.empty()
+          && link_file(dirfds, target->second, real_filename))
+      {
+        PKG_PROBE3(extract__done, archive_filename.c_str(),
+                   archive_entry_size(entry), 2);
+        continue;
+      }
+    }
+
+    /*
+     * Upgrade of a regular file whose contents did not change: only
+     * fix up the metadata instead of rewriting the whole file.
+     */
+    struct stat st;
+    int         fd = -1;
+
+    if (   upgrade
+        && real_filename == original_filename
+        && S_ISREG(archive_entry_mode(entry))
+        && !archive_entry_hardlink(entry)
+        && lstat(real_filename.c_str(), &st) == 0
+        && S_ISREG(st.st_mode)
+        && st.st_size == archive_entry_size(entry))
+    {
+      fd = open(real_filename.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+      if (fd != -1 && has_extended_metadata(entry, fd))
+      {
+        close(fd);
+        fd = -1;
+      }
+    }
+
     /*
      * Extract file.
      */
-    auto flags =
-        ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM
-      | ARCHIVE_EXTRACT_TIME  | ARCHIVE_EXTRACT_UNLINK
-#ifdef ENABLE_EXTRACT_ACL
-      | ARCHIVE_EXTRACT_ACL
-#endif
-#ifdef ENABLE_EXTRACT_XATTR
-      | ARCHIVE_EXTRACT_XATTR
-#endif
-      ;
+    int r;
+    int fixup_errno = 0;
+
+    if (fd != -1)
+    {
+      r = extract_if_changed(archive, disk, entry, fd);
+
+      if (r == 1 && fixup_metadata(disk, entry, fd, st) == -1)
+      {
+        fixup_errno = errno;
+        r = -1;
+      }
 
-    if (archive_read_extract(archive, entry, flags) != ARCHIVE_OK)
+      close(fd);
+    }
+    else
+      r = (archive_read_extract2(archive, entry, disk) == ARCHIVE_OK)
+        ? 0 : -1;
+
+    PKG_PROBE3(extract__done, archive_filename.c_str(),
+               archive_entry_size(entry), r);
+
+    if (r == 0 && tx && S_ISREG(archive_entry_mode(entry)))
+      tx->bytes += archive_entry_size(entry);
+
+    if (r != -1 && real_filename == original_filename)
+    {
+      map<string, string>::iterator
+        target = link_targets.find(archive_filename);
+
+      if (target != link_targets.end())
+        target->second = real_filename;
+    }
+
+    if (r == -1)
     {
       /* If a file fails to install we just print an error message and
        * continue trying to install the rest of the package, unless
        * this is not an upgrade. */
-      const char* msg = archive_error_string(archive);
+      const char* msg = fixup_errno ? strerror(fixup_errno)
+                                    : archive_error_string(archive);
       cerr << utilname << ": could not install " +
         archive_filename << ": " << msg << endl;
 
@@ -629,6 +2406,7 @@ pkgutil::pkg_install(const string& filename,
         throw runtime_error("extract error: " + archive_filename +
                             ": " + msg);
       }
+      complete = false;
       continue;
     }
 
@@ -659,8 +2437,13 @@ pkgutil::pkg_install(const string& filename,
       if (remove_file)
         file_remove(reject_dir, real_filename);
       else
+      {
         cout << utilname << ": rejecting " << archive_filename
              << ", keeping existing version" << endl;
+
+        if (tx)
+          ++tx->rejected;
+      }
     }
   }
 
@@ -672,7 +2455,17 @@ pkgutil::pkg_install(const string& filename,
       throw runtime_error("could not read " + filename);
   }
 
+  for (map<string, int>::const_iterator
+        j = dirfds.begin(); j != dirfds.end(); ++j)
+  {
+    if (j->second != -1)
+      close(j->second);
+  }
+
+  archive_write_free(disk);
   archive_read_free(archive);
+
+  return complete;
 }
 
 void
@@ -699,8 +2492,14 @@ pkgutil::ldconfig()
     }
     else
     {
-      if (waitpid(pid, 0, 0) == -1)
+      int status = 0;
+
+      PKG_PROBE2(ldconfig__spawn, root.c_str(), pid);
+
+      if (waitpid(pid, &status, 0) == -1)
         throw runtime_error_with_errno("waitpid() failed");
+
+      PKG_PROBE2(ldconfig__exit, pid, status);
     }
   }
 }
@@ -722,78 +2521,135 @@ pkgutil::pkg_footprint(const string& filename)
     uid_t  uid;
     gid_t  gid;
     mode_t mode;
+    mode_t perm;   /* mode shown, the target's for hardlinks */
     bool operator < (const struct file& other)
     {
       return (path < other.path);
     }
-    bool operator < (const string& other)
-    {
-      return (path < other);
-    }
   };
 
   vector<struct file> files;
+  map<string, mode_t> link_targets;
 
   /*
-   * We first do a run over the archive and remember the modes of
-   * regular files.  In the second run, we print the footprint - using
-   * the stored modes for hardlinks.
-   *
-   * FIXME the code duplication here is butt ugly.
+   * We first do a run over the archive and remember the hardlink
+   * groups.  Then the permissions of the group targets are resolved
+   * and shown for the links, which keep their own type and size.
    */
-  archive = archive_read_new();
-  INIT_ARCHIVE(archive);
+  bool listed = false;
 
-  if (archive_read_open_filename(archive,
-                                 filename.c_str(),
-                                 DEFAULT_BYTES_PER_BLOCK)
-      != ARCHIVE_OK)
+#ifdef ENABLE_NATIVE_TAR
+  listed = tar_list(filename, [&](const tar_entry_t& entry)
   {
-    throw runtime_error_with_errno("could not open " + filename,
-        archive_errno(archive));
+    struct file file;
+
+    file.path = entry.path;
+    if (S_ISLNK(entry.mode))
+      file.soft = entry.link;
+    if (entry.hardlink)
+    {
+      file.hard = entry.link;
+      link_targets[file.hard] = 0;
+    }
+
+    file.size = entry.size;
+    file.rdev = entry.rdev;
+    file.uid  = entry.uid;
+    file.gid  = entry.gid;
+    file.mode = entry.mode;
+    file.perm = entry.mode;
+
+    files.push_back(file);
+  });
+
+  if (!listed)
+  {
+    files.clear();
+    link_targets.clear();
   }
+#endif
 
-  for (i = 0;
-        archive_read_next_header(archive, &entry) == ARCHIVE_OK;
-        ++i)
+  if (!listed)
   {
+    archive = archive_read_new();
+    INIT_ARCHIVE(archive);
 
-    struct file file;
-    const char* s;
+    if (archive_read_open_filename(archive,
+                                   filename.c_str(),
+                                   DEFAULT_BYTES_PER_BLOCK)
+        != ARCHIVE_OK)
+    {
+      throw runtime_error_with_errno("could not open " + filename,
+          archive_errno(archive));
+    }
+
+    for (i = 0;
+          archive_read_next_header(archive, &entry) == ARCHIVE_OK;
+          ++i)
+    {
 
-    if ((s = archive_entry_pathname(entry)))
-      file.path = s;
+      struct file file;
+      const char* s;
 
-    if ((s = archive_entry_symlink(entry)))
-      file.soft = s;
+      if ((s = archive_entry_pathname(entry)))
+        file.path = s;
 
-    if ((s = archive_entry_hardlink(entry)))
-      file.hard = s;
+      if ((s = archive_entry_symlink(entry)))
+        file.soft = s;
 
-    file.size = archive_entry_size(entry);
-    file.rdev = archive_entry_rdev(entry);
-    file.uid  = archive_entry_uid(entry);
-    file.gid  = archive_entry_gid(entry);
-    file.mode = archive_entry_mode(entry);
+      if ((s = archive_entry_hardlink(entry)))
+      {
+        file.hard = s;
+        link_targets[file.hard] = 0;
+      }
 
-    files.push_back(file);
+      file.size = archive_entry_size(entry);
+      file.rdev = archive_entry_rdev(entry);
+      file.uid  = archive_entry_uid(entry);
+      file.gid  = archive_entry_gid(entry);
+      file.mode = archive_entry_mode(entry);
+      file.perm = file.mode;
+
+      files.push_back(file);
+
+      if (S_ISREG(file.mode) && archive_read_data_skip(archive))
+      {
+        throw runtime_error_with_errno("could not read " + filename,
+                                        archive_errno(archive));
+      }
+    }
 
-    if (S_ISREG(file.mode) && archive_read_data_skip(archive))
+    if (i == 0)
     {
-      throw runtime_error_with_errno("could not read " + filename,
-                                      archive_errno(archive));
+      if (archive_errno(archive) == 0)
+        throw runtime_error("empty package");
+      else
+        throw runtime_error("could not read " + filename);
     }
+
+    archive_read_free(archive);
   }
 
-  if (i == 0)
+  /*
+   * Resolve hardlink permissions.
+   */
+  if (!link_targets.empty())
   {
-    if (archive_errno(archive) == 0)
-      throw runtime_error("empty package");
-    else
-      throw runtime_error("could not read " + filename);
-  }
+    for (i = 0; i < files.size(); ++i)
+    {
+      map<string, mode_t>::iterator
+        target = link_targets.find(files[i].path);
 
-  archive_read_free(archive);
+      if (target != link_targets.end() && files[i].hard.empty())
+        target->second = files[i].mode;
+    }
+
+    for (i = 0; i < files.size(); ++i)
+    {
+      if (files[i].hard.length())
+        files[i].perm = link_targets[files[i].hard];
+    }
+  }
 
   sort(files.begin(), files.end());
 
@@ -815,15 +2671,7 @@ pkgutil::pkg_footprint(const string& filename)
       cout << "lrwxrwxrwx";
     }
     else
-    {
-      if (file.hard.length())
-      {
-        auto it = lower_bound(files.begin(), files.end(), file.hard);
-        cout << mtos(it->mode);
-      }
-      else
-        cout << mtos(file.mode);
-    }
+      cout << mtos(file.perm);
 
     cout << '\t';
 
@@ -865,9 +2713,9 @@ pkgutil::pkg_footprint(const string& filename)
       /* Device. */
       cout << " (" << major(file.rdev) << ", " << minor(file.rdev) << ")";
     }
-    else if (S_ISREG(file.mode) && file.size == 0)
+    else if (S_ISREG(file.mode) && file.size == 0 && file.hard.empty())
     {
-      /* Empty regular file. */
+      /* Empty regular file, hardlinks have no data of their own. */
       cout << " (EMPTY)";
     }
 
@@ -875,18 +2723,229 @@ pkgutil::pkg_footprint(const string& filename)
   }
 }
 
+void
+pkgutil::pkg_check_space(const pkginfo_t&   info,
+                         const manifest_t&  manifest,
+                         const set<string>& keep_list)
+  const
+{
+  struct mount_t
+  {
+    string      path;     /* a directory on this filesystem */
+    off_t       bytes;    /* space needed */
+    long long   files;    /* inodes needed */
+    off_t       frsize;
+    off_t       bavail;
+    long long   favail;
+    bool        inodes;   /* the filesystem limits inodes */
+  };
+
+  map<dev_t, mount_t>  mounts;
+  map<string, dev_t>   dirs;
+
+  for (set<string>::const_iterator
+        i = info.files.begin(); i != info.files.end(); ++i)
+  {
+    const bool is_dir = (*i)[i->length() - 1] == '/';
+
+    string      path = root + *i;
+    struct stat st;
+    bool        exists = lstat(path.c_str(), &st) == 0;
+
+    if (exists && is_dir)
+      continue;
+
+    /* rejected files are extracted below the rejected directory */
+    if (exists && keep_list.find(*i) != keep_list.end())
+    {
+      path   = trim_filename(root + PKG_REJECTED + "/" + *i);
+      exists = false;
+    }
+
+    /*
+     * Find the filesystem by the nearest existing directory.
+     */
+    string dir = path.substr(0, path.rfind('/', path.length() - 2) + 1);
+    map<string, dev_t>::iterator d = dirs.find(dir);
+
+    if (d == dirs.end())
+    {
+      struct stat dst;
+      string      parent = dir;
+
+      int r;
+
+      while (   (r = stat(parent.c_str(), &dst)) == -1
+             && parent.length() > 1)
+      {
+        parent.erase(parent.rfind('/', parent.length() - 2) + 1);
+      }
+
+      if (r == -1)
+        throw runtime_error_with_errno("could not stat " + parent);
+
+      d = dirs.insert(make_pair(dir, dst.st_dev)).first;
+
+      if (mounts.find(dst.st_dev) == mounts.end())
+      {
+        struct statvfs vfs;
+
+        if (statvfs(parent.c_str(), &vfs) == -1)
+          throw runtime_error_with_errno("could not stat filesystem of "
+                                         + parent);
+
+        mount_t& m = mounts[dst.st_dev];
+
+        m.path   = parent;
+        m.bytes  = 0;
+        m.files  = 0;
+        m.frsize = vfs.f_frsize ? vfs.f_frsize : vfs.f_bsize;
+        m.inodes = vfs.f_files != 0;
+
+        /* root may use the reserved blocks and inodes */
+        if (geteuid() == 0)
+        {
+          m.bavail = vfs.f_bfree * m.frsize;
+          m.favail = vfs.f_ffree;
+        }
+        else
+        {
+          m.bavail = vfs.f_bavail * m.frsize;
+          m.favail = vfs.f_favail;
+        }
+      }
+    }
+
+    mount_t& m = mounts[d->second];
+
+    /*
+     * New contents in whole filesystem blocks, minus the space of the
+     * file they replace.
+     */
+    map<string, off_t>::const_iterator
+      size = manifest.sizes.find(*i);
+
+    if (is_dir)
+      m.bytes += m.frsize;
+    else if (size != manifest.sizes.end())
+      m.bytes += (size->second + m.frsize - 1) / m.frsize * m.frsize;
+
+    if (exists)
+      m.bytes -= st.st_blocks * 512;
+    else if (manifest.hardlinks.find(*i) == manifest.hardlinks.end())
+      m.files++;
+  }
+
+  for (map<dev_t, mount_t>::const_iterator
+        i = mounts.begin(); i != mounts.end(); ++i)
+  {
+    const mount_t& m = i->second;
+
+    if (m.bytes > m.bavail)
+      throw runtime_error("not enough disk space in " + m.path + ": " +
+          to_string(m.bytes / 1024) + " KiB needed, " +
+          to_string(m.bavail / 1024) + " KiB available");
+
+    /* filesystems without inode limits report 0 inodes in total */
+    if (m.inodes && m.files > m.favail)
+      throw runtime_error("not enough inodes in " + m.path + ": " +
+          to_string(m.files) + " needed, " +
+          to_string(m.favail) + " available");
+  }
+}
+
+void
+pkgutil::parallel_for(size_t count,
+                      const function<void(size_t, size_t)>& fn)
+  const
+{
+  /*
+   * Run FN for chunks [begin, end) of the range [0, COUNT) on the
+   * shared thread pool.  FN must not throw.
+   */
+  if (!pool)
+    pool.reset(new thread_pool(jobs ? jobs : available_cpus()));
+
+  pool->run(count, PARALLEL_CHUNK, fn);
+}
+
+void
+pkgutil::set_jobs(const string& value)
+{
+  /*
+   * Number of threads, from --jobs or the environment.
+   */
+  char*         end;
+  unsigned long n = strtoul(value.c_str(), &end, 10);
+
+  if (value.empty() || *end || value[0] == '-' || n > 1024)
+    throw invalid_argument("invalid number of jobs: " + value);
+
+  jobs = n;
+}
+
+void
+pkgutil::latency_enable()
+{
+  latency.reset(new latency_stats);
+}
+
+void
+pkgutil::latency_report()
+  const
+{
+  if (!latency)
+    return;
+
+  latency->lstat.print(cout, "conflict lstat");
+  latency->extract.print(cout, "extract");
+  latency->unlink.print(cout, "unlink");
+}
+
+void
+pkgutil::tx_begin(const string& op, const string& path)
+{
+  /* the root is known before the database is opened, so that
+   * failures to lock it are logged as well */
+  root = trim_filename(path + "/");
+  tx.reset(new txlog(utilname, op));
+}
+
+void
+pkgutil::tx_phase(const char* name)
+{
+  if (tx)
+    tx->phase(name);
+}
+
+void
+pkgutil::tx_end(const string& outcome, const string& error)
+{
+  if (tx)
+    tx->write(root, outcome, error);
+
+  tx.reset();
+}
+
 void
 pkgutil::print_version()
   const
 {
   cout << utilname << " (pkgutils) " << VERSION << endl;
-#if defined(ENABLE_EXTRACT_ACL) || defined(ENABLE_EXTRACT_XATTR)
+#if defined(ENABLE_EXTRACT_ACL) || defined(ENABLE_EXTRACT_XATTR) || \
+    defined(ENABLE_ZSTD_DB) || defined(ENABLE_SQLITE_DB)
   cout << "Compiled with options: "
 #ifdef ENABLE_EXTRACT_ACL
        << "+acl "
 #endif
 #ifdef ENABLE_EXTRACT_XATTR
        << "+xattr "
+#endif
+#ifdef ENABLE_ZSTD_DB
+       << "+zstd "
+#endif
+#ifdef ENABLE_SQLITE_DB
+       << "+sqlite "
 #endif
        << endl;
 #endif
@@ -901,16 +2960,19 @@ db_lock::db_lock(const string& root, bool exclusive)
     throw runtime_error_with_errno("could not read directory " +
                                     dirname);
 
+  PKG_PROBE2(lock__acquire, dirname.c_str(), exclusive);
+
   if (flock(dirfd(dir),
         (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) == -1)
   {
     if (errno == EWOULDBLOCK)
-      throw runtime_error(
-          "package database is currently locked by another process");
+      throw db_locked_error();
     else
       throw runtime_error_with_errno("could not lock directory " +
                                       dirname);
   }
+
+  PKG_PROBE2(lock__acquired, dirname.c_str(), exclusive);
 }
 
 db_lock::~db_lock()
@@ -918,6 +2980,7 @@ db_lock::~db_lock()
   if (dir)
   {
     flock(dirfd(dir), LOCK_UN);
+    PKG_PROBE0(lock__release);
     closedir(dir);
   }
 }
@@ -1111,6 +3174,103 @@ permissions_equal(const string& file1, const string& file2)
        && (buf1.st_gid  == buf2.st_gid);
 }
 
+string
+file_digest(const string& filename)
+{
+  /*
+   * Size and a fast 64-bit hash of the contents, to tell whether a
+   * file is the very same as before.  This is not meant to be
+   * cryptographically secure.
+   */
+  const uint64_t k1 = 0x9e3779b185ebca87ULL;
+  const uint64_t k2 = 0xc2b2ae3d27d4eb4fULL;
+
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    throw runtime_error_with_errno("could not open " + filename);
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  uint64_t h    = k1;
+  uint64_t size = 0;
+  uint64_t buf[8192];
+  ssize_t  n;
+
+  do
+  {
+    /* fill whole blocks, so that the words don't depend on how
+     * read() splits the file */
+    size_t filled = 0;
+
+    while (   filled < sizeof(buf)
+           && (n = read(fd, reinterpret_cast<char*>(buf) + filled,
+                        sizeof(buf) - filled)) > 0)
+    {
+      filled += n;
+    }
+
+    if (n == -1)
+    {
+      close(fd);
+      throw runtime_error_with_errno("could not read " + filename);
+    }
+
+    /* zero the tail so that the last word is well defined */
+    memset(reinterpret_cast<char*>(buf) + filled, 0,
+           (8 - filled % 8) % 8);
+
+    for (size_t i = 0; i < (filled + 7) / 8; ++i)
+    {
+      h ^= buf[i] * k2;
+      h  = ((h << 31) | (h >> 33)) * k1;
+    }
+    size += filled;
+  }
+  while (n > 0);
+
+  close(fd);
+
+  h ^= size;
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  char digest[64];
+  snprintf(digest, sizeof(digest), "%llu:%016llx",
+           static_cast<unsigned long long>(size),
+           static_cast<unsigned long long>(h));
+
+  return digest;
+}
+
+void
+file_replace(const string& filename, const string& data)
+{
+  /*
+   * Replace the contents of a small file atomically.
+   */
+  const string filename_new = filename + ".new";
+
+  int fd = open(filename_new.c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0444);
+  if (fd == -1)
+    throw runtime_error_with_errno("could not create " + filename_new);
+
+  if (   write(fd, data.data(), data.size())
+         != static_cast<ssize_t>(data.size())
+      || fsync(fd) == -1)
+  {
+    close(fd);
+    throw runtime_error_with_errno("could not write " + filename_new);
+  }
+
+  close(fd);
+
+  if (rename(filename_new.c_str(), filename.c_str()) == -1)
+    throw runtime_error_with_errno("could not rename " +
+                                filename_new + " to " + filename);
+}
+
 void
 file_remove(const string& basedir, const string& filename)
 {
@@ -7,7 +7,10 @@
 #include <string>
 #include <set>
 #include <map>
+#include <memory>
+#include <vector>
 #include <iostream>
+#include <functional>
 #include <stdexcept>
 #include <cerrno>
 #include <cstring>
@@ -19,20 +22,47 @@
 
 using namespace std;
 
+class db_backend;
+class thread_pool;
+struct latency_stats;
+class txlog;
+
 class pkgutil
 {
+  friend class db_text;
+
 public:
   struct pkginfo_t
   {
     string      version;
     set<string> files;
+
+    /* file_digest() of the installed package file, if known */
+    string      identity;
   };
 
   typedef map<string, pkginfo_t> packages_t;
 
+  /*
+   * Details about a package archive gathered while listing it.
+   */
+  struct manifest_t
+  {
+    manifest_t() : size(0) {}
+
+    /* hardlink groups: link -> target */
+    map<string, string> hardlinks;
+
+    /* size of the regular files, hardlinked data counted once */
+    off_t               size;
+
+    /* sizes of the regular files, hardlinks excluded */
+    map<string, off_t>  sizes;
+  };
+
   explicit pkgutil(const string& name);
 
-  virtual ~pkgutil() {}
+  virtual ~pkgutil();
 
   virtual void run(int argc, char** argv) = 0;
 
@@ -46,8 +76,16 @@ protected:
    */
   void db_open(const string& path);
 
+  bool db_open_names(const string& path);
+
+  bool db_open_pkg(const string& path, const string& name);
+
+  bool db_open_owner(const string& path, const string& file);
+
   void db_commit();
 
+  void db_convert(const string& layout);
+
   void db_add_pkg(const string& name, const pkginfo_t& info);
 
   bool db_find_pkg(const string& name);
@@ -60,23 +98,102 @@ protected:
 
   set<string> db_find_conflicts(const string& name, const pkginfo_t& info);
 
+  size_t db_check(const string& path, bool on_disk, bool repair);
+
+  void db_select();
+
+  void db_read_file(packages_t& packages);
+
+  void db_read_shards(const vector<string>& names, packages_t& packages);
+
+  bool db_read_names(packages_t& packages);
+
+  void db_write_file(const packages_t& packages);
+
+  void db_write_shards(const string& dirname, const set<string>& names,
+                       const packages_t& packages);
+
+  void db_write_indexes();
+
   /*
    * Tar.gz.
    */
-  pair<string, pkginfo_t> pkg_open(const string& filename) const;
+  pair<string, string> pkg_name(const string& filename) const;
 
-  void pkg_install(const string& filename, const set<string>& keep_list,
+  pair<string, pkginfo_t> pkg_open(const string& filename,
+                                   manifest_t* manifest = 0) const;
+
+  /* returns false if some files of an upgrade failed to install */
+  bool pkg_install(const string& filename, const manifest_t& manifest,
+                   const set<string>& keep_list,
                    const set<string>& non_install_files, bool upgrade) const;
 
   void pkg_footprint(const string& filename) const;
 
+  void pkg_check_space(const pkginfo_t& info, const manifest_t& manifest,
+                       const set<string>& keep_list) const;
+
   void ldconfig() const;
 
+  /*
+   * Parallel execution.
+   */
+  void parallel_for(size_t count,
+                    const function<void(size_t, size_t)>& fn) const;
+
+  void set_jobs(const string& value);
+
+  /*
+   * Latency statistics.
+   */
+  void latency_enable();
+
+  void latency_report() const;
+
+  /*
+   * Transaction log.
+   */
+  void tx_begin(const string& op, const string& path);
+
+  void tx_phase(const char* name);
+
+  void tx_end(const string& outcome, const string& error = "");
+
   string utilname;
 
   packages_t packages;
 
   string root;
+
+  /* backend of the database that was opened, see db.h */
+  unique_ptr<db_backend> db;
+
+  /* the database was compressed with zstd(1) when it was read */
+  bool db_compressed;
+
+  /* the database is a directory with one file per package */
+  bool db_sharded;
+
+  /* the database is opened to be changed, with an exclusive lock */
+  bool db_exclusive;
+
+  /* journal of a commit not completed yet, see db_select() */
+  map<string, bool> db_pending;
+
+  /* packages added, removed or changed since the database was read */
+  set<string> db_changed;
+
+  /* threads of parallel_for(), 0 for the available CPUs */
+  size_t jobs;
+
+  /* started by the first parallel_for() */
+  mutable unique_ptr<thread_pool> pool;
+
+  /* per-file latencies, null unless enabled by -vv */
+  mutable unique_ptr<latency_stats> latency;
+
+  /* record of the running transaction, null without one */
+  mutable unique_ptr<txlog> tx;
 }; // class pkgutil
 
 class db_lock
@@ -99,6 +216,17 @@ public:
     : runtime_error(msg + string(": ") + strerror(e)) {}
 }; // class runtime_error_with_errno
 
+/*
+ * The package database is locked by another process.
+ */
+class db_locked_error : public runtime_error
+{
+public:
+  db_locked_error() throw()
+    : runtime_error(
+        "package database is currently locked by another process") {}
+}; // class db_locked_error
+
 /*
  * Utility functions.
  */
@@ -114,6 +242,10 @@ bool file_equal(const string& file1, const string& file2);
 
 bool permissions_equal(const string& file1, const string& file2);
 
+string file_digest(const string& filename);
+
+void file_replace(const string& filename, const string& data);
+
 void file_remove(const string& basedir, const string& filename);
 
 // vim: sw=2 ts=2 sts=2 et cc=72 tw=70
@@ -0,0 +1,64 @@
+//! \file  probes.h
+//! \brief Statically defined tracing probes.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#pragma once
+
+/*
+ * Probes of the "pkgutils" provider, for bpftrace(8), SystemTap or
+ * perf(1) with ENABLE_USDT, e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/sbin/pkgadd:pkgutils:extract__done
+ *                { printf("%s %d\n", str(arg0), arg1); }'
+ *
+ *   db__open__start        (root)
+ *   db__open__done         (root, packages)
+ *   db__commit__start      (root, changed packages)
+ *   db__commit__done       (root, changed packages)
+ *   conflicts__phase__start(phase)
+ *   conflicts__phase__done (phase, conflicting files)
+ *   extract__start         (path, size)
+ *   extract__done          (path, size, result: 0 written,
+ *                           1 metadata only, 2 linked, -1 failed)
+ *   remove__file           (path, errno or 0)
+ *   lock__acquire          (database directory, exclusive)
+ *   lock__acquired         (database directory, exclusive)
+ *   lock__release          ()
+ *   ldconfig__spawn        (root, pid)
+ *   ldconfig__exit         (pid, wait status)
+ *
+ * Strings are NUL-terminated char pointers, numbers are integers.
+ * An enabled probe is a single nop plus an ELF note; its arguments
+ * are only computed into registers.  Without ENABLE_USDT the probes
+ * expand to nothing and their arguments are not evaluated.
+ */
+
+#ifdef ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define PKG_PROBE0(name) \
+  DTRACE_PROBE(pkgutils, name)
+#define PKG_PROBE1(name, a) \
+  DTRACE_PROBE1(pkgutils, name, a)
+#define PKG_PROBE2(name, a, b) \
+  DTRACE_PROBE2(pkgutils, name, a, b)
+#define PKG_PROBE3(name, a, b, c) \
+  DTRACE_PROBE3(pkgutils, name, a, b, c)
+
+#else
+
+/* sizeof() keeps the arguments type-checked but unevaluated */
+#define PKG_PROBE0(name) \
+  do { } while (0)
+#define PKG_PROBE1(name, a) \
+  do { (void) sizeof(a); } while (0)
+#define PKG_PROBE2(name, a, b) \
+  do { (void) sizeof(a); (void) sizeof(b); } while (0)
+#define PKG_PROBE3(name, a, b, c) \
+  do { (void) sizeof(a); (void) sizeof(b); (void) sizeof(c); } while (0)
+
+#endif // ENABLE_USDT
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
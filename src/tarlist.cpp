@@ -0,0 +1,731 @@
+//! \file  tarlist.cpp
+//! \brief Native listing of tar(1) package files implementation.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#ifdef ENABLE_NATIVE_TAR
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#include <lzma.h>
+#include <zstd.h>
+
+#include "tarlist.h"
+
+#define TAR_BLOCK   512
+
+/* decompressed bytes kept for parsing, also the largest long name or
+ * pax header handled */
+#define TAR_WINDOW  (256 * 1024)
+
+/* compressed bytes read at once */
+#define TAR_INPUT   (64 * 1024)
+
+/*
+ * Decompressed contents of a package file.  Owns FD.
+ */
+class tar_source
+{
+public:
+  explicit tar_source(int fd)
+    : fd(fd), in_pos(0), in_size(0), eof(false) {}
+
+  virtual ~tar_source() { close(fd); }
+
+  /* up to N bytes into BUF, 0 at the end, -1 on error */
+  virtual ssize_t read(char* buf, size_t n) = 0;
+
+  /* skip N bytes without reading them, if possible */
+  virtual bool seek(uint64_t) { return false; }
+
+protected:
+  /* read more input once all of it was consumed */
+  bool fill()
+  {
+    if (in_pos < in_size || eof)
+      return true;
+
+    if (in.empty())
+      in.resize(TAR_INPUT);
+
+    ssize_t n = ::read(fd, &in[0], in.size());
+    if (n == -1)
+      return false;
+
+    in_pos  = 0;
+    in_size = n;
+    eof     = n == 0;
+
+    return true;
+  }
+
+  /* at least N bytes of input, N <= TAR_INPUT */
+  bool need(size_t n)
+  {
+    if (in.empty())
+      in.resize(TAR_INPUT);
+
+    while (in_size - in_pos < n)
+    {
+      if (eof)
+        return false;
+
+      memmove(&in[0], &in[in_pos], in_size - in_pos);
+      in_size -= in_pos;
+      in_pos   = 0;
+
+      ssize_t r = ::read(fd, &in[in_size], in.size() - in_size);
+      if (r <= 0)
+      {
+        eof = true;
+        return false;
+      }
+      in_size += r;
+    }
+
+    return true;
+  }
+
+  int           fd;
+  vector<char>  in;
+  size_t        in_pos;
+  size_t        in_size;
+  bool          eof;
+}; // class tar_source
+
+/*
+ * Uncompressed contents.
+ */
+class raw_source : public tar_source
+{
+public:
+  explicit raw_source(int fd) : tar_source(fd) {}
+
+  virtual ssize_t read(char* buf, size_t n) override
+  {
+    return ::read(fd, buf, n);
+  }
+
+  virtual bool seek(uint64_t n) override
+  {
+    return lseek(fd, n, SEEK_CUR) != -1;
+  }
+}; // class raw_source
+
+/*
+ * gzip(1) compressed contents, concatenated members included.  The
+ * headers are parsed here and the members inflated as raw deflate
+ * streams, so their CRC-32 is not computed: a corrupt stream is still
+ * detected by inflate(), and the files are extracted by libarchive.
+ */
+class gzip_source : public tar_source
+{
+public:
+  explicit gzip_source(int fd)
+    : tar_source(fd), member(false), trailer(false), members(0)
+  {
+    memset(&zs, 0, sizeof(zs));
+    ok = inflateInit2(&zs, -15) == Z_OK;
+  }
+
+  virtual ~gzip_source() { if (ok) inflateEnd(&zs); }
+
+  virtual ssize_t read(char* buf, size_t n) override
+  {
+    if (!ok)
+      return -1;
+
+    zs.next_out  = reinterpret_cast<Bytef*>(buf);
+    zs.avail_out = n;
+
+    while (zs.avail_out == n)
+    {
+      if (!member)
+      {
+        /* CRC-32 and size of the previous member */
+        if (trailer && !need(8))
+          return -1;
+        if (trailer)
+          in_pos += 8;
+        trailer = false;
+
+        if (!need(1))
+          return members ? 0 : -1;
+        if (!header())
+          return -1;
+
+        member = true;
+        ++members;
+      }
+
+      if (!fill())
+        return -1;
+
+      zs.next_in  = reinterpret_cast<Bytef*>(&in[in_pos]);
+      zs.avail_in = in_size - in_pos;
+
+      int rc = inflate(&zs, Z_NO_FLUSH);
+      in_pos = in_size - zs.avail_in;
+
+      if (rc == Z_STREAM_END)
+      {
+        member  = false;
+        trailer = true;
+        inflateReset(&zs);
+      }
+      else if (rc == Z_BUF_ERROR ? eof : rc != Z_OK)
+        return -1;
+    }
+
+    return n - zs.avail_out;
+  }
+
+private:
+  /* skip a member header, see RFC 1952 */
+  bool header()
+  {
+    if (!need(10))
+      return false;
+
+    const unsigned char* h =
+      reinterpret_cast<const unsigned char*>(&in[in_pos]);
+    int flags = h[3];
+
+    if (h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || (flags & 0xe0))
+      return false;
+    in_pos += 10;
+
+    if (flags & 4)        /* FEXTRA */
+    {
+      if (!need(2))
+        return false;
+      size_t len = static_cast<unsigned char>(in[in_pos]) |
+                   static_cast<unsigned char>(in[in_pos + 1]) << 8;
+      in_pos += 2;
+      if (!need(len))
+        return false;
+      in_pos += len;
+    }
+
+    for (int flag = 8; flag <= 16; flag <<= 1)
+    {
+      if (!(flags & flag))  /* FNAME, FCOMMENT */
+        continue;
+      do
+      {
+        if (!need(1))
+          return false;
+      }
+      while (in[in_pos++]);
+    }
+
+    if (flags & 2)        /* FHCRC */
+    {
+      if (!need(2))
+        return false;
+      in_pos += 2;
+    }
+
+    return true;
+  }
+
+  z_stream  zs;
+  bool      ok;
+  bool      member;
+  bool      trailer;
+  size_t    members;
+}; // class gzip_source
+
+/*
+ * xz(1) compressed contents.
+ */
+class xz_source : public tar_source
+{
+public:
+  explicit xz_source(int fd)
+    : tar_source(fd), ls(LZMA_STREAM_INIT), ended(false)
+  {
+    ok = lzma_stream_decoder(&ls, UINT64_MAX, LZMA_CONCATENATED)
+      == LZMA_OK;
+  }
+
+  virtual ~xz_source() { lzma_end(&ls); }
+
+  virtual ssize_t read(char* buf, size_t n) override
+  {
+    if (!ok)
+      return -1;
+
+    ls.next_out  = reinterpret_cast<uint8_t*>(buf);
+    ls.avail_out = n;
+
+    while (ls.avail_out == n && !ended)
+    {
+      if (!fill())
+        return -1;
+
+      ls.next_in  = reinterpret_cast<uint8_t*>(&in[in_pos]);
+      ls.avail_in = in_size - in_pos;
+
+      lzma_ret rc = lzma_code(&ls, eof ? LZMA_FINISH : LZMA_RUN);
+      in_pos = in_size - ls.avail_in;
+
+      if (rc == LZMA_STREAM_END)
+        ended = true;
+      else if (rc != LZMA_OK)
+        return -1;
+    }
+
+    return n - ls.avail_out;
+  }
+
+private:
+  lzma_stream ls;
+  bool        ok;
+  bool        ended;
+}; // class xz_source
+
+/*
+ * zstd(1) compressed contents.
+ */
+class zstd_source : public tar_source
+{
+public:
+  explicit zstd_source(int fd)
+    : tar_source(fd), ds(ZSTD_createDStream()), hint(1) {}
+
+  virtual ~zstd_source() { ZSTD_freeDStream(ds); }
+
+  virtual ssize_t read(char* buf, size_t n) override
+  {
+    if (!ds)
+      return -1;
+
+    for (;;)
+    {
+      if (!fill())
+        return -1;
+
+      ZSTD_inBuffer  ib = { in.empty() ? 0 : &in[0], in_size, in_pos };
+      ZSTD_outBuffer ob = { buf, n, 0 };
+
+      hint = ZSTD_decompressStream(ds, &ob, &ib);
+      if (ZSTD_isError(hint))
+        return -1;
+
+      in_pos = ib.pos;
+
+      if (ob.pos)
+        return ob.pos;
+      if (eof)
+        return hint == 0 ? 0 : -1;
+    }
+  }
+
+private:
+  ZSTD_DStream* ds;
+  size_t        hint;
+}; // class zstd_source
+
+/*
+ * Decompressed contents split into blocks, parsed in place.
+ */
+class tar_blocks
+{
+public:
+  explicit tar_blocks(tar_source& src)
+    : src(src), buf(TAR_WINDOW), pos(0), end(0) {}
+
+  /* next N contiguous bytes, or 0 at the end or on error */
+  const char* get(size_t n)
+  {
+    if (n > buf.size())
+      return 0;
+
+    if (end - pos < n)
+    {
+      memmove(&buf[0], &buf[pos], end - pos);
+      end -= pos;
+      pos  = 0;
+
+      while (end < n)
+      {
+        ssize_t r = src.read(&buf[end], buf.size() - end);
+        if (r <= 0)
+          return 0;
+        end += r;
+      }
+    }
+
+    const char* p = &buf[pos];
+    pos += n;
+
+    return p;
+  }
+
+  /* skip N bytes */
+  bool skip(uint64_t n)
+  {
+    if (n <= end - pos)
+    {
+      pos += n;
+      return true;
+    }
+
+    n -= end - pos;
+    pos = end = 0;
+
+    if (src.seek(n))
+      return true;
+
+    while (n)
+    {
+      ssize_t r = src.read(&buf[0], buf.size());
+      if (r <= 0)
+        return false;
+
+      if (static_cast<uint64_t>(r) > n)
+      {
+        pos = n;
+        end = r;
+        break;
+      }
+      n -= r;
+    }
+
+    return true;
+  }
+
+private:
+  tar_source&   src;
+  vector<char>  buf;
+  size_t        pos;
+  size_t        end;
+}; // class tar_blocks
+
+/*
+ * Attributes of the next member from GNU long name or pax headers.
+ */
+struct tar_override_t
+{
+  tar_override_t()
+    : has_path(false), has_link(false),
+      has_size(false), has_uid(false), has_gid(false) {}
+
+  string    path;
+  string    link;
+  uint64_t  size, uid, gid;
+  bool      has_path, has_link, has_size, has_uid, has_gid;
+};
+
+static inline uint64_t
+tar_round(uint64_t n)
+{
+  return (n + TAR_BLOCK - 1) & ~static_cast<uint64_t>(TAR_BLOCK - 1);
+}
+
+/*
+ * Numeric header field, octal or base-256.
+ */
+static bool
+tar_number(const char* field, size_t len, uint64_t& value)
+{
+  value = 0;
+
+  if (len && (field[0] & 0x80))
+  {
+    if (field[0] & 0x40)
+      return false;
+
+    value = field[0] & 0x3f;
+    for (size_t i = 1; i < len; ++i)
+    {
+      if (value >> 55)
+        return false;
+      value = value << 8 | static_cast<unsigned char>(field[i]);
+    }
+    return true;
+  }
+
+  size_t i = 0;
+
+  while (i < len && field[i] == ' ')
+    ++i;
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+    value = value * 8 + (field[i] - '0');
+  for (; i < len; ++i)
+  {
+    if (field[i] != ' ' && field[i] != '\0')
+      return false;
+  }
+
+  return true;
+}
+
+static bool
+tar_decimal(const string& s, uint64_t& value)
+{
+  value = 0;
+
+  if (s.empty() || s.length() > 18)
+    return false;
+
+  for (size_t i = 0; i < s.length(); ++i)
+  {
+    if (s[i] < '0' || s[i] > '9')
+      return false;
+    value = value * 10 + (s[i] - '0');
+  }
+
+  return true;
+}
+
+/*
+ * Check the header checksum, given the SUM of all its bytes.
+ */
+static bool
+tar_checksum(const char* header, unsigned long sum)
+{
+  uint64_t expected;
+
+  if (!tar_number(header + 148, 8, expected))
+    return false;
+
+  for (size_t i = 148; i < 156; ++i)
+    sum -= static_cast<unsigned char>(header[i]);
+
+  return sum + 8 * ' ' == expected;
+}
+
+/*
+ * Records "LENGTH KEY=VALUE\n" of a pax extended header.  Only the
+ * attributes pkgutils lists are kept, sparse files are refused.
+ */
+static bool
+tar_pax(const char* p, size_t n, tar_override_t& next)
+{
+  while (n)
+  {
+    size_t len = 0, i = 0;
+
+    for (; i < n && p[i] >= '0' && p[i] <= '9' && len < n; ++i)
+      len = len * 10 + (p[i] - '0');
+
+    if (i == n || p[i] != ' ' || len > n || len < i + 3 ||
+        p[len - 1] != '\n')
+      return false;
+
+    const char* kv  = p + i + 1;
+    size_t      kvl = len - i - 2;
+    const char* eq  = static_cast<const char*>(memchr(kv, '=', kvl));
+    if (!eq)
+      return false;
+
+    string key(kv, eq);
+    string value(eq + 1, kv + kvl);
+
+    if (key == "path")
+    {
+      next.path.swap(value);
+      next.has_path = true;
+    }
+    else if (key == "linkpath")
+    {
+      next.link.swap(value);
+      next.has_link = true;
+    }
+    else if (key == "size")
+    {
+      if (!(next.has_size = tar_decimal(value, next.size)))
+        return false;
+    }
+    else if (key == "uid")
+    {
+      if (!(next.has_uid = tar_decimal(value, next.uid)))
+        return false;
+    }
+    else if (key == "gid")
+    {
+      if (!(next.has_gid = tar_decimal(value, next.gid)))
+        return false;
+    }
+    else if (key.compare(0, 10, "GNU.sparse") == 0)
+      return false;
+
+    p += len;
+    n -= len;
+  }
+
+  return true;
+}
+
+static bool
+tar_scan(tar_source& src, const function<void(const tar_entry_t&)>& fn)
+{
+  tar_blocks      blocks(src);
+  tar_entry_t     entry;
+  tar_override_t  next;
+  size_t          count = 0;
+
+  for (;;)
+  {
+    const char* h = blocks.get(TAR_BLOCK);
+    if (!h)
+      return false;
+
+    unsigned long sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; ++i)
+      sum += static_cast<unsigned char>(h[i]);
+
+    /* end of archive, an empty one is left to libarchive */
+    if (!sum)
+      return count > 0;
+
+    if (!tar_checksum(h, sum))
+      return false;
+
+    bool ustar = memcmp(h + 257, "ustar\0" "00", 8) == 0;
+    bool gnu   = memcmp(h + 257, "ustar  \0", 8) == 0;
+    if (!ustar && !gnu)
+      return false;
+
+    uint64_t mode, uid, gid, size, devmajor, devminor;
+
+    if (   !tar_number(h + 100, 8,  mode)
+        || !tar_number(h + 108, 8,  uid)
+        || !tar_number(h + 116, 8,  gid)
+        || !tar_number(h + 124, 12, size)
+        || !tar_number(h + 329, 8,  devmajor)
+        || !tar_number(h + 337, 8,  devminor))
+      return false;
+
+    char type = h[156];
+
+    if (type == 'L' || type == 'K' || type == 'x')
+    {
+      const char* data = size < TAR_WINDOW
+                       ? blocks.get(tar_round(size)) : 0;
+      if (!data)
+        return false;
+
+      if (type == 'L')
+      {
+        next.path.assign(data, strnlen(data, size));
+        next.has_path = true;
+      }
+      else if (type == 'K')
+      {
+        next.link.assign(data, strnlen(data, size));
+        next.has_link = true;
+      }
+      else if (!tar_pax(data, size, next))
+        return false;
+
+      continue;
+    }
+
+    mode_t ftype;
+
+    switch (type)
+    {
+    case '0': case '\0': case '7':
+    case '1': ftype = S_IFREG;  break;
+    case '2': ftype = S_IFLNK;  break;
+    case '3': ftype = S_IFCHR;  break;
+    case '4': ftype = S_IFBLK;  break;
+    case '5': ftype = S_IFDIR;  break;
+    case '6': ftype = S_IFIFO;  break;
+    default:
+      /* global pax headers, sparse files, volumes, ... */
+      return false;
+    }
+
+    if (next.has_size)
+      size = next.size;
+
+    /* only regular files have data, hardlinks with data are odd */
+    bool data = type == '0' || type == '\0' || type == '7';
+    if (!data && size)
+      return false;
+
+    if (next.has_path)
+      entry.path.swap(next.path);
+    else if (ustar && h[345])
+    {
+      entry.path.assign(h + 345, strnlen(h + 345, 155));
+      entry.path += '/';
+      entry.path.append(h, strnlen(h, 100));
+    }
+    else
+      entry.path.assign(h, strnlen(h, 100));
+
+    if (next.has_link)
+      entry.link.swap(next.link);
+    else
+      entry.link.assign(h + 157, strnlen(h + 157, 100));
+
+    entry.hardlink = type == '1';
+    entry.mode     = ftype | (mode & 07777);
+    entry.uid      = next.has_uid ? next.uid : uid;
+    entry.gid      = next.has_gid ? next.gid : gid;
+    entry.size     = size;
+    entry.rdev     = (ftype == S_IFCHR || ftype == S_IFBLK)
+                   ? makedev(devmajor, devminor) : 0;
+
+    if (entry.path.empty())
+      return false;
+
+    fn(entry);
+    ++count;
+
+    next = tar_override_t();
+
+    if (!blocks.skip(tar_round(size)))
+      return false;
+  }
+}
+
+bool
+tar_list(const string& filename,
+         const function<void(const tar_entry_t&)>& fn)
+{
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+
+  unsigned char magic[6];
+  ssize_t       n = pread(fd, magic, sizeof(magic), 0);
+
+  unique_ptr<tar_source> src;
+
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    src.reset(new gzip_source(fd));
+  else if (n == 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0)
+    src.reset(new xz_source(fd));
+  else if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+                     magic[2] == 0x2f && magic[3] == 0xfd)
+    src.reset(new zstd_source(fd));
+  else if (n == 6 && (   memcmp(magic, "BZh", 3) == 0
+                      || memcmp(magic, "LZIP", 4) == 0))
+  {
+    close(fd);
+    return false;
+  }
+  else
+    src.reset(new raw_source(fd));
+
+  return tar_scan(*src, fn);
+}
+
+#endif // ENABLE_NATIVE_TAR
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
@@ -0,0 +1,46 @@
+//! \file  tarlist.h
+//! \brief Native listing of tar(1) package files.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#pragma once
+
+#ifdef ENABLE_NATIVE_TAR
+
+#include <string>
+#include <functional>
+
+#include <sys/types.h>
+
+using namespace std;
+
+/*
+ * Header fields of an archive member.  The strings are reused for
+ * the next member.
+ */
+struct tar_entry_t
+{
+  string  path;
+  string  link;       /* target of a symlink or hardlink */
+  bool    hardlink;
+  mode_t  mode;       /* file type and permissions */
+  uid_t   uid;
+  gid_t   gid;
+  off_t   size;
+  dev_t   rdev;
+};
+
+/*
+ * Call FN for each member of the uncompressed, gzip, xz or zstd
+ * compressed tar file FILENAME, reading ustar, GNU and pax headers
+ * from the decompressed blocks.  Returns false if anything, from the
+ * compression to a member type, is not handled here, possibly after
+ * FN was called for some members; the caller then starts over with
+ * libarchive(3), which also reports the errors.
+ */
+bool tar_list(const string& filename,
+              const function<void(const tar_entry_t&)>& fn);
+
+#endif // ENABLE_NATIVE_TAR
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
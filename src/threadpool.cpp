@@ -0,0 +1,271 @@
+//! \file  threadpool.cpp
+//! \brief Work-stealing thread pool implementation.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+
+#include <sched.h>
+
+#include "threadpool.h"
+
+/* participating in a job, nested jobs run serially */
+static thread_local bool in_pool = false;
+
+/*
+ * CPUs granted by a bandwidth quota of QUOTA us every PERIOD us,
+ * rounded up.
+ */
+static size_t
+quota_cpus(long long quota, long long period)
+{
+  if (quota <= 0 || period <= 0)
+    return 0;
+
+  return (quota + period - 1) / period;
+}
+
+/*
+ * Smallest CPU quota of the cgroup PATH and its ancestors, or 0 if
+ * there is none.  The cgroup v2 "cpu.max" file holds "max PERIOD" or
+ * "QUOTA PERIOD"; the v1 controller splits them into two files.
+ */
+static size_t
+cgroup_cpus(const string& mount, string path, bool v2)
+{
+  size_t limit = 0;
+
+  for (;;)
+  {
+    string    dir = mount + path;
+    long long quota = 0, period = 0;
+
+    if (v2)
+    {
+      ifstream in(dir + "/cpu.max");
+      string   max;
+
+      if (in >> max >> period && max != "max")
+        quota = atoll(max.c_str());
+    }
+    else
+    {
+      ifstream q(dir + "/cpu.cfs_quota_us");
+      ifstream p(dir + "/cpu.cfs_period_us");
+
+      if (!(q >> quota && p >> period))
+        quota = 0;
+    }
+
+    size_t cpus = quota_cpus(quota, period);
+    if (cpus && (!limit || cpus < limit))
+      limit = cpus;
+
+    if (path.empty() || path == "/")
+      break;
+
+    string::size_type slash = path.rfind('/');
+    path.erase(slash == string::npos ? 0 : slash);
+  }
+
+  return limit;
+}
+
+size_t
+available_cpus()
+{
+  size_t    cpus = 0;
+  cpu_set_t set;
+
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    cpus = CPU_COUNT(&set);
+  if (!cpus)
+    cpus = thread::hardware_concurrency();
+
+  /*
+   * Lines of /proc/self/cgroup are "ID:CONTROLLERS:PATH", the unified
+   * hierarchy has ID 0 and no controllers.  Inside a cgroup namespace
+   * PATH is "/", otherwise it may not exist below the mount point and
+   * only the limits of its visible ancestors are found.
+   */
+  ifstream in("/proc/self/cgroup");
+  string   line;
+
+  while (getline(in, line))
+  {
+    string::size_type c1 = line.find(':');
+    string::size_type c2 = line.find(':', c1 + 1);
+    if (c1 == string::npos || c2 == string::npos)
+      continue;
+
+    string controllers = "," + line.substr(c1 + 1, c2 - c1 - 1) + ",";
+    string path        = line.substr(c2 + 1);
+    size_t limit       = 0;
+
+    if (line.compare(0, c2 + 1, "0::") == 0)
+      limit = cgroup_cpus("/sys/fs/cgroup", path, true);
+    else if (controllers.find(",cpu,") != string::npos)
+      limit = cgroup_cpus("/sys/fs/cgroup/cpu", path, false);
+
+    if (limit && limit < cpus)
+      cpus = limit;
+  }
+
+  return cpus ? cpus : 1;
+}
+
+thread_pool::thread_pool(size_t nthreads)
+  : shares(new share_t[nthreads ? nthreads : 1]),
+    generation(0), active(0), busy(0), stopping(false),
+    job(0), count(0), chunk(1)
+{
+  for (size_t i = 0; i < size(); ++i)
+    shares[i].lo = shares[i].hi = 0;
+
+  for (size_t i = 1; i < nthreads; ++i)
+    workers.push_back(thread(&thread_pool::worker, this, i));
+}
+
+thread_pool::~thread_pool()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+
+  for (size_t i = 0; i < workers.size(); ++i)
+    workers[i].join();
+}
+
+void
+thread_pool::run(size_t count, size_t chunk,
+                 const function<void(size_t, size_t)>& fn)
+{
+  if (!chunk)
+    chunk = 1;
+
+  size_t nchunks = (count + chunk - 1) / chunk;
+  size_t nactive = min(size(), nchunks);
+
+  if (in_pool || nactive <= 1)
+  {
+    for (size_t begin = 0; begin < count; begin += chunk)
+      fn(begin, min(begin + chunk, count));
+    return;
+  }
+
+  /*
+   * Split the chunks evenly, the shares are only touched by the
+   * participants once the job is published.
+   */
+  for (size_t i = 0; i < size(); ++i)
+  {
+    lock_guard<mutex> guard(shares[i].lock);
+    shares[i].lo = i < nactive ? nchunks * i / nactive       : 0;
+    shares[i].hi = i < nactive ? nchunks * (i + 1) / nactive : 0;
+  }
+
+  {
+    lock_guard<mutex> guard(lock);
+    this->job   = &fn;
+    this->count = count;
+    this->chunk = chunk;
+    active      = nactive;
+    busy        = nactive - 1;
+    ++generation;
+  }
+  wake.notify_all();
+
+  work(0);
+
+  unique_lock<mutex> guard(lock);
+  done.wait(guard, [this] { return busy == 0; });
+  job = 0;
+}
+
+void
+thread_pool::work(size_t self)
+{
+  size_t index;
+
+  in_pool = true;
+  while (take(self, index))
+  {
+    size_t begin = index * chunk;
+    (*job)(begin, min(begin + chunk, count));
+  }
+  in_pool = false;
+}
+
+bool
+thread_pool::take(size_t self, size_t& index)
+{
+  {
+    lock_guard<mutex> guard(shares[self].lock);
+    if (shares[self].lo < shares[self].hi)
+    {
+      index = shares[self].lo++;
+      return true;
+    }
+  }
+
+  /*
+   * Steal the upper half of the first share with chunks left, run
+   * its first chunk and keep the rest as our own share.
+   */
+  for (size_t i = 1; i < active; ++i)
+  {
+    share_t& victim = shares[(self + i) % active];
+    size_t   lo, hi;
+
+    {
+      lock_guard<mutex> guard(victim.lock);
+      if (victim.lo == victim.hi)
+        continue;
+
+      hi = victim.hi;
+      victim.hi -= (victim.hi - victim.lo + 1) / 2;
+      lo = victim.hi;
+    }
+
+    index = lo;
+
+    lock_guard<mutex> guard(shares[self].lock);
+    shares[self].lo = lo + 1;
+    shares[self].hi = hi;
+    return true;
+  }
+
+  return false;
+}
+
+void
+thread_pool::worker(size_t self)
+{
+  size_t seen = 0;
+
+  unique_lock<mutex> guard(lock);
+  for (;;)
+  {
+    wake.wait(guard, [&] { return stopping || generation != seen; });
+    if (stopping)
+      break;
+
+    seen = generation;
+    if (self >= active)
+      continue;
+
+    guard.unlock();
+    work(self);
+    guard.lock();
+
+    if (--busy == 0)
+      done.notify_one();
+  }
+}
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
@@ -0,0 +1,77 @@
+//! \file  threadpool.h
+//! \brief Work-stealing thread pool.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Number of CPUs this process may run on: the affinity mask, limited
+ * by the CPU bandwidth quota of its cgroup (cpu.max), if any.
+ */
+size_t available_cpus();
+
+/*
+ * Pool of worker threads running ranges of chunks.  Each participant
+ * gets its own contiguous share of the chunks and, once done with it,
+ * steals half of what is left of another share.
+ */
+class thread_pool
+{
+public:
+  /* NTHREADS participants, the calling thread included */
+  explicit thread_pool(size_t nthreads);
+
+  ~thread_pool();
+
+  size_t size() const { return workers.size() + 1; }
+
+  /*
+   * Run FN for chunks [begin, end) of the range [0, COUNT) and wait
+   * for all of them.  FN must not throw.  Nested calls from FN run
+   * serially in the calling thread.
+   */
+  void run(size_t count, size_t chunk,
+           const function<void(size_t, size_t)>& fn);
+
+private:
+  /* chunks [lo, hi) not yet taken from a participant's share */
+  struct share_t
+  {
+    mutex   lock;
+    size_t  lo;
+    size_t  hi;
+  };
+
+  void work(size_t self);
+  bool take(size_t self, size_t& index);
+  void worker(size_t self);
+
+  vector<thread>                workers;
+  unique_ptr<share_t[]>         shares;
+
+  mutex                         lock;
+  condition_variable            wake;
+  condition_variable            done;
+  size_t                        generation;
+  size_t                        active;
+  size_t                        busy;
+  bool                          stopping;
+
+  /* current job */
+  const function<void(size_t, size_t)>* job;
+  size_t                        count;
+  size_t                        chunk;
+}; // class thread_pool
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
@@ -0,0 +1,198 @@
+//! \file  txlog.cpp
+//! \brief Transaction log implementation.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "latency.h"
+#include "pathnames.h"
+#include "txlog.h"
+
+/*
+ * String as a JSON string literal.  Bytes that are not valid UTF-8
+ * are passed through unchanged.
+ */
+static string
+json_string(const string& s)
+{
+  string out = "\"";
+
+  for (string::size_type i = 0; i < s.size(); ++i)
+  {
+    unsigned char c = s[i];
+
+    if (c == '"' || c == '\\')
+    {
+      out += '\\';
+      out += c;
+    }
+    else if (c == '\n')
+      out += "\\n";
+    else if (c == '\t')
+      out += "\\t";
+    else if (c < 0x20 || c == 0x7f)
+    {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    }
+    else
+      out += c;
+  }
+
+  return out + "\"";
+}
+
+/*
+ * UTC time in ISO 8601 format with milliseconds.
+ */
+static string
+iso_time(const struct timespec& ts)
+{
+  struct tm tm;
+  char      buf[32];
+  char      ms[16];
+
+  gmtime_r(&ts.tv_sec, &tm);
+  strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(ms, sizeof(ms), ".%03dZ",
+           static_cast<int>(ts.tv_nsec / 1000000 % 1000));
+
+  return string(buf) + ms;
+}
+
+txlog::txlog(const string& utility, const string& op)
+  : added(0), removed(0), rejected(0), ignored(0), bytes(0),
+    utility(utility), op(op)
+{
+  clock_gettime(CLOCK_REALTIME, &started);
+  start = phase_start = latency_now();
+  phases.push_back(make_pair("lock", 0));
+}
+
+void
+txlog::phase(const char* name)
+{
+  uint64_t now = latency_now();
+
+  phases.back().second += now - phase_start;
+  phase_start = now;
+  phases.push_back(make_pair(name, 0));
+}
+
+void
+txlog::write(const string& root, const string& outcome,
+             const string& error)
+{
+  struct timespec ended;
+  uint64_t        now = latency_now();
+
+  clock_gettime(CLOCK_REALTIME, &ended);
+  phases.back().second += now - phase_start;
+  phase_start = now;
+
+  /*
+   * One line per transaction, the durations in microseconds.
+   */
+  string line = "{\"start\":" + json_string(iso_time(started))
+    + ",\"end\":"         + json_string(iso_time(ended))
+    + ",\"utility\":"     + json_string(utility)
+    + ",\"pid\":"         + to_string(getpid())
+    + ",\"op\":"          + json_string(op)
+    + ",\"package\":"     + json_string(package);
+
+  if (!file.empty())
+    line += ",\"file\":" + json_string(file);
+  if (!old_version.empty())
+    line += ",\"old_version\":" + json_string(old_version);
+  if (!new_version.empty())
+    line += ",\"new_version\":" + json_string(new_version);
+
+  line += ",\"added\":"        + to_string(added)
+    +     ",\"removed\":"      + to_string(removed)
+    +     ",\"rejected\":"     + to_string(rejected)
+    +     ",\"ignored\":"      + to_string(ignored)
+    +     ",\"bytes\":"        + to_string(bytes)
+    +     ",\"lock_wait_us\":" + to_string(phases.front().second / 1000)
+    +     ",\"phases_us\":{";
+
+  for (size_t i = 1; i < phases.size(); ++i)
+  {
+    line += (i > 1 ? ",\"" : "\"") + string(phases[i].first) + "\":"
+          + to_string(phases[i].second / 1000);
+  }
+
+  line += "},\"duration_us\":" + to_string((now - start) / 1000)
+    + ",\"outcome\":" + json_string(outcome);
+
+  if (!error.empty())
+    line += ",\"error\":" + json_string(error);
+
+  line += "}\n";
+
+  /*
+   * Append the line and rotate the log if it grew too large.  The
+   * lock of the log itself serializes writers that do not hold the
+   * database lock, e.g. after a failure; a writer that got the lock
+   * of an already rotated file leaves it alone.
+   */
+  const string logname = root + PKG_TXLOG;
+
+  int fd = open(logname.c_str(),
+                O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1)
+  {
+    /* no database, e.g. a wrong root */
+    if (errno == ENOENT)
+      return;
+
+    const char* msg = strerror(errno);
+    cerr << utility << ": could not open " << logname << ": "
+         << msg << endl;
+    return;
+  }
+
+  flock(fd, LOCK_EX);
+
+  if (::write(fd, line.data(), line.size()) == -1)
+  {
+    const char* msg = strerror(errno);
+    cerr << utility << ": could not write " << logname << ": "
+         << msg << endl;
+  }
+
+  struct stat st, cur;
+
+  if (   fstat(fd, &st) == 0 && st.st_size > PKG_TXLOG_MAX
+      && stat(logname.c_str(), &cur) == 0 && cur.st_ino == st.st_ino)
+  {
+    for (int i = PKG_TXLOG_KEEP - 1; i >= 0; --i)
+    {
+      const string from = i ? logname + "." + to_string(i) : logname;
+      const string to   = logname + "." + to_string(i + 1);
+
+      if (rename(from.c_str(), to.c_str()) == -1 && errno != ENOENT)
+      {
+        const char* msg = strerror(errno);
+        cerr << utility << ": could not rename " << from << ": "
+             << msg << endl;
+        break;
+      }
+    }
+  }
+
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
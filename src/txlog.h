@@ -0,0 +1,64 @@
+//! \file  txlog.h
+//! \brief Transaction log of pkgadd and pkgrm.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <time.h>
+
+using namespace std;
+
+/*
+ * Summary of one pkgadd or pkgrm transaction, appended as a line of
+ * JSON to PKG_TXLOG when it is done.  Its phases follow each other:
+ * the first one, "lock", is the attempt to acquire the database lock,
+ * each call of phase() ends the current one.  db_lock does not wait
+ * for another process, so the "lock_wait_us" of the record is the
+ * time of that single attempt; contention shows up as transactions
+ * with the outcome "locked".
+ */
+class txlog
+{
+public:
+  txlog(const string& utility, const string& op);
+
+  void phase(const char* name);
+
+  /*
+   * Append the record with OUTCOME ("ok", "unchanged", "locked" or
+   * "error") and ERROR, if any, to the log below ROOT and rotate the
+   * log once it grew beyond PKG_TXLOG_MAX.  Failures are only
+   * reported, nothing is logged if there is no database directory.
+   */
+  void write(const string& root, const string& outcome,
+             const string& error);
+
+  string    package;
+  string    file;           /* package file of pkgadd */
+  string    old_version;    /* version replaced or removed */
+  string    new_version;    /* version installed */
+
+  size_t    added;          /* files new to the package */
+  size_t    removed;        /* files deleted from the root */
+  size_t    rejected;       /* files kept in PKG_REJECTED */
+  size_t    ignored;        /* files not installed due to rules */
+  uint64_t  bytes;          /* file data written */
+
+private:
+  string          utility;
+  string          op;
+  struct timespec started;
+  uint64_t        start;
+  uint64_t        phase_start;
+
+  /* names and durations in nanoseconds */
+  vector<pair<const char*, uint64_t>> phases;
+}; // class txlog
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
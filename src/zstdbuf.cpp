@@ -0,0 +1,153 @@
+//! \file  zstdbuf.cpp
+//! \brief Stream buffers for zstd(1) compressed files implementation.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#ifdef ENABLE_ZSTD_DB
+
+#include <unistd.h>
+
+#include "zstdbuf.h"
+
+bool
+zstd_magic(int fd)
+{
+  unsigned char magic[4];
+
+  return pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+      && magic[0] == 0x28 && magic[1] == 0xb5
+      && magic[2] == 0x2f && magic[3] == 0xfd;
+}
+
+zstd_ibuf::zstd_ibuf(int fd)
+  : fd(fd), ds(ZSTD_createDStream()),
+    in(ZSTD_DStreamInSize()), in_pos(0), in_size(0),
+    out(ZSTD_DStreamOutSize()), error(!ds)
+{
+  if (ds)
+    ZSTD_initDStream(ds);
+}
+
+zstd_ibuf::~zstd_ibuf()
+{
+  ZSTD_freeDStream(ds);
+}
+
+zstd_ibuf::int_type
+zstd_ibuf::underflow()
+{
+  if (gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+
+  while (!error)
+  {
+    if (in_pos == in_size)
+    {
+      ssize_t n = read(fd, &in[0], in.size());
+
+      if (n == -1)
+        error = true;
+      if (n <= 0)
+        break;
+
+      in_size = n;
+      in_pos  = 0;
+    }
+
+    ZSTD_inBuffer  ib = { &in[0],  in_size,    in_pos };
+    ZSTD_outBuffer ob = { &out[0], out.size(), 0      };
+
+    if (ZSTD_isError(ZSTD_decompressStream(ds, &ob, &ib)))
+      error = true;
+
+    in_pos = ib.pos;
+
+    if (ob.pos)
+    {
+      setg(&out[0], &out[0], &out[0] + ob.pos);
+      return traits_type::to_int_type(out[0]);
+    }
+  }
+
+  return traits_type::eof();
+}
+
+zstd_obuf::zstd_obuf(int fd, int level)
+  : fd(fd), cs(ZSTD_createCStream()),
+    in(ZSTD_CStreamInSize()), out(ZSTD_CStreamOutSize()), pending(false)
+{
+  if (cs)
+    ZSTD_initCStream(cs, level);
+
+  setp(&in[0], &in[0] + in.size());
+}
+
+zstd_obuf::~zstd_obuf()
+{
+  ZSTD_freeCStream(cs);
+}
+
+bool
+zstd_obuf::compress(ZSTD_EndDirective mode)
+{
+  if (!cs)
+    return false;
+
+  ZSTD_inBuffer ib = { pbase(), static_cast<size_t>(pptr() - pbase()), 0 };
+  size_t        remaining;
+
+  if (ib.size)
+    pending = true;
+
+  do
+  {
+    ZSTD_outBuffer ob = { &out[0], out.size(), 0 };
+
+    remaining = ZSTD_compressStream2(cs, &ob, &ib, mode);
+    if (ZSTD_isError(remaining))
+      return false;
+
+    for (size_t done = 0; done < ob.pos; )
+    {
+      ssize_t n = write(fd, &out[done], ob.pos - done);
+      if (n == -1)
+        return false;
+      done += n;
+    }
+  }
+  while (mode == ZSTD_e_end ? remaining != 0 : ib.pos < ib.size);
+
+  setp(&in[0], &in[0] + in.size());
+
+  return true;
+}
+
+zstd_obuf::int_type
+zstd_obuf::overflow(int_type c)
+{
+  if (!compress(ZSTD_e_continue))
+    return traits_type::eof();
+
+  if (!traits_type::eq_int_type(c, traits_type::eof()))
+    sputc(traits_type::to_char_type(c));
+
+  return traits_type::not_eof(c);
+}
+
+int
+zstd_obuf::sync()
+{
+  if (pptr() == pbase() && !pending)
+    return 0;
+
+  if (!compress(ZSTD_e_end))
+    return -1;
+
+  pending = false;
+
+  return 0;
+}
+
+#endif // ENABLE_ZSTD_DB
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.
@@ -0,0 +1,75 @@
+//! \file  zstdbuf.h
+//! \brief Stream buffers for zstd(1) compressed files.
+//!        See COPYING and COPYRIGHT files for corresponding information.
+
+#pragma once
+
+#ifdef ENABLE_ZSTD_DB
+
+#include <streambuf>
+#include <vector>
+
+#include <zstd.h>
+
+using namespace std;
+
+/*
+ * Magic number at the beginning of a zstd frame.
+ */
+bool zstd_magic(int fd);
+
+/*
+ * Input buffer decompressing from a file descriptor.
+ */
+class zstd_ibuf : public streambuf
+{
+public:
+  explicit zstd_ibuf(int fd);
+
+  virtual ~zstd_ibuf();
+
+  bool failed() const { return error; }
+
+protected:
+  virtual int_type underflow() override;
+
+private:
+  int            fd;
+  ZSTD_DStream*  ds;
+  vector<char>   in;
+  size_t         in_pos;
+  size_t         in_size;
+  vector<char>   out;
+  bool           error;
+}; // class zstd_ibuf
+
+/*
+ * Output buffer compressing to a file descriptor.  The frame is ended
+ * on sync(), i.e. when the stream is flushed.
+ */
+class zstd_obuf : public streambuf
+{
+public:
+  zstd_obuf(int fd, int level);
+
+  virtual ~zstd_obuf();
+
+protected:
+  virtual int_type overflow(int_type c) override;
+
+  virtual int sync() override;
+
+private:
+  bool compress(ZSTD_EndDirective mode);
+
+  int            fd;
+  ZSTD_CStream*  cs;
+  vector<char>   in;
+  vector<char>   out;
+  bool           pending;
+}; // class zstd_obuf
+
+#endif // ENABLE_ZSTD_DB
+
+// vim: sw=2 ts=2 sts=2 et cc=72 tw=70
+// End of file.